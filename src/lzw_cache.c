@@ -0,0 +1,657 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
+#include "lzw_cache.h"
+#include "sha256.h"
+
+
+/**************************   Prototypes   ************************************/
+
+
+static enum lzw_error claim_dir(struct lzw_cache *cache);
+
+static bool is_empty_dir(const char *dir_name);
+
+static bool is_entry_name(const char *name);
+
+static enum lzw_error hash_file(
+        char *name,
+        uint8_t digest[SHA256_DIGEST_SIZE]
+);
+
+static enum lzw_error decompress_to_tmp(
+        struct lzw_cache *cache,
+        char *src_name,
+        bool sparse,
+        char *tmp_path
+);
+
+static enum lzw_error serve_entry(int entry_fd, char *dst_name, bool sparse);
+
+static enum lzw_error copy_entry(int entry_fd, int dst_fd, bool sparse);
+
+static void evict(struct lzw_cache *cache, const char *keep);
+
+static void stamp_entry(struct lzw_cache *cache, const char *entry_name);
+
+static void get_stamp_name(
+        const char *entry_name,
+        char *stamp_name
+);
+
+static int compare_by_last_use(const void *a, const void *b);
+
+static int compare_times(const struct timespec *a, const struct timespec *b);
+
+
+/****************************   Macros   **************************************/
+
+
+/* Size of the buffer used when reading or copying files. */
+#define COPY_BUF_SIZE (64 * 1024)
+
+/*
+ * Entries being written are given names starting with this prefix, and are
+ * renamed to their key once complete. Only names that are keys are ever
+ * served or counted towards the cache size.
+ */
+#define TMP_PREFIX ".tmp-"
+
+/*
+ * Temporary files older than this, in seconds, were left by a process that
+ * died while writing them, and are removed when evicting.
+ */
+#define STALE_TMP_SEC (24 * 60 * 60)
+
+/*
+ * Created in every directory used as a cache. A directory without it is only
+ * used if it is empty, so that eviction never removes files the cache did
+ * not create.
+ */
+#define MARKER_NAME ".lzw-cache"
+
+/*
+ * A use of an entry by a user other than its owner, who cannot bump the
+ * entry's modification time, is recorded by replacing a stamp file named
+ * with this prefix followed by the entry's name.
+ */
+#define STAMP_PREFIX ".used-"
+
+/* Size of a stamp's name, including the terminating null. */
+#define STAMP_NAME_SIZE (sizeof(STAMP_PREFIX) + SHA256_DIGEST_SIZE * 2)
+
+/* Permissions of published entries: writable by the owner, readable by all. */
+#define ENTRY_MODE 0644
+
+/* A file in the cache directory, as seen when deciding what to evict. */
+struct cache_file {
+    char name[NAME_MAX + 1];
+    off_t size;
+    struct timespec last_use;  // Latest of the entry's and its stamp's
+                               // modification times.
+};
+
+
+/****************************   Public API   **********************************/
+
+
+/**
+ * Decompresses `src_name` into `dst_name`, going through the cache.
+ *
+ * Entries are named after the SHA-256 digest of the compressed input, in hex.
+ * The hash is collision resistant, so a crafted input cannot be made to
+ * share a key with, and so be served the output of, another input.
+ *
+ * On a hit, the entry is cloned (reflinked) into the destination where the
+ * filesystem supports it, and copied (sparsely if `sparse` is set) otherwise.
+ * Its modification time is bumped so that eviction is least-recently-used.
+ * Only the entry's owner can do so, so other users record the use in a stamp
+ * file instead (see `stamp_entry`).
+ *
+ * On a miss, the input is decompressed into a temporary file in the cache
+ * directory, made readable by all so that processes running as other users
+ * can share the cache, which is then renamed to its key. As rename is atomic,
+ * other processes only ever see complete entries. The destination is then
+ * served from the new entry, and the oldest entries are evicted until the
+ * cache is back under `cache->max_size`.
+ *
+ * Entries are not hard linked to the destination, as writing to the
+ * destination afterwards would then corrupt the cache.
+ *
+ * The directory is created if need be. An existing directory is only used if
+ * the cache created it or it is empty, otherwise LZW_CACHE_ERROR is returned.
+ *
+ * @param cache The cache to go through.
+ * @param src_name Path to the compressed source file.
+ * @param dst_name Path to the destination file.
+ * @param sparse Whether to write the output sparsely when decompressing.
+ * @return LZW_OKAY if no error, otherwise the error encountered.
+ */
+enum lzw_error lzw_cache_decompress(
+        struct lzw_cache *cache,
+        char *src_name,
+        char *dst_name,
+        bool sparse
+) {
+    assert(cache);
+    assert(cache->dir);
+
+    enum lzw_error error = claim_dir(cache);
+    if (lzw_has_error(error)) {
+        return error;
+    }
+
+    /* Work out the key of the source. */
+
+    uint8_t digest[SHA256_DIGEST_SIZE];
+    error = hash_file(src_name, digest);
+    if (lzw_has_error(error)) {
+        return error;
+    }
+
+    char entry_name[SHA256_DIGEST_SIZE * 2 + 1];
+    for (int i = 0; i < SHA256_DIGEST_SIZE; i++) {
+        snprintf(&entry_name[i * 2], 3, "%02x", digest[i]);
+    }
+
+    char entry_path[PATH_MAX];
+    int n = snprintf(entry_path, sizeof(entry_path), "%s/%s",
+                     cache->dir, entry_name);
+    if (n < 0 || (size_t) n >= sizeof(entry_path)) {
+        return LZW_CACHE_ERROR;
+    }
+
+    /* Hit: serve the entry and mark it as recently used. */
+
+    int entry_fd = open(entry_path, O_RDONLY);
+    if (entry_fd >= 0) {
+        if (futimens(entry_fd, NULL) != 0) {
+            stamp_entry(cache, entry_name);
+        }
+        error = serve_entry(entry_fd, dst_name, sparse);
+        close(entry_fd);
+        return error;
+    }
+
+    /* Miss: decompress into a temporary file, then publish it. */
+
+    char tmp_path[PATH_MAX];
+    error = decompress_to_tmp(cache, src_name, sparse, tmp_path);
+    if (lzw_has_error(error)) {
+        return error;
+    }
+
+    // Keep the entry open across the rename so it can still be served if
+    // another process evicts it straight after.
+    entry_fd = open(tmp_path, O_RDONLY);
+    if (entry_fd < 0 || rename(tmp_path, entry_path) != 0) {
+        if (entry_fd >= 0) {
+            close(entry_fd);
+        }
+        unlink(tmp_path);
+        return LZW_CACHE_ERROR;
+    }
+
+    error = serve_entry(entry_fd, dst_name, sparse);
+    close(entry_fd);
+
+    evict(cache, entry_name);
+
+    return error;
+}
+
+
+/*****************************   Helpers   ************************************/
+
+
+/**
+ * Makes sure the cache directory exists and belongs to the cache, creating it
+ * and marking it with `MARKER_NAME` if need be.
+ * @return LZW_OKAY if the directory can be used, LZW_CACHE_ERROR otherwise,
+ * including if it holds files the cache did not create.
+ */
+static enum lzw_error claim_dir(struct lzw_cache *cache) {
+    if (mkdir(cache->dir, 0777) != 0 && errno != EEXIST) {
+        return LZW_CACHE_ERROR;
+    }
+
+    char marker_path[PATH_MAX];
+    int n = snprintf(marker_path, sizeof(marker_path), "%s/" MARKER_NAME,
+                     cache->dir);
+    if (n < 0 || (size_t) n >= sizeof(marker_path)) {
+        return LZW_CACHE_ERROR;
+    }
+
+    if (access(marker_path, F_OK) == 0) {
+        return LZW_OKAY;
+    }
+
+    if (!is_empty_dir(cache->dir)) {
+        return LZW_CACHE_ERROR;
+    }
+
+    int marker_fd = open(marker_path, O_WRONLY | O_CREAT, 0666);
+    if (marker_fd < 0) {
+        return LZW_CACHE_ERROR;
+    }
+    close(marker_fd);
+
+    return LZW_OKAY;
+}
+
+/**
+ * Checks whether a directory holds nothing but what the cache may have put
+ * there while another process was claiming it: the marker, temporary files
+ * and stamps.
+ * @return true if so, false otherwise or if the directory cannot be read.
+ */
+static bool is_empty_dir(const char *dir_name) {
+    DIR *dir = opendir(dir_name);
+    if (!dir) {
+        return false;
+    }
+
+    bool empty = true;
+    struct dirent *ent;
+
+    while (empty && (ent = readdir(dir))) {
+        empty = strcmp(ent->d_name, ".") == 0 ||
+                strcmp(ent->d_name, "..") == 0 ||
+                strcmp(ent->d_name, MARKER_NAME) == 0 ||
+                strncmp(ent->d_name, TMP_PREFIX, strlen(TMP_PREFIX)) == 0 ||
+                strncmp(ent->d_name, STAMP_PREFIX, strlen(STAMP_PREFIX)) == 0;
+    }
+
+    closedir(dir);
+
+    return empty;
+}
+
+/**
+ * Checks whether a file name is that of an entry, the lowercase hex of a
+ * SHA-256 digest.
+ */
+static bool is_entry_name(const char *name) {
+    size_t i = 0;
+
+    for (; name[i] != '\0'; i++) {
+        bool hex_digit = (name[i] >= '0' && name[i] <= '9') ||
+                         (name[i] >= 'a' && name[i] <= 'f');
+        if (!hex_digit) {
+            return false;
+        }
+    }
+
+    return i == SHA256_DIGEST_SIZE * 2;
+}
+
+/**
+ * Computes the SHA-256 digest of the given file.
+ * @return `enum lzw_error` error code.
+ */
+static enum lzw_error hash_file(
+        char *name,
+        uint8_t digest[SHA256_DIGEST_SIZE]
+) {
+    assert(digest);
+
+    FILE *f = name ? fopen(name, "rb") : NULL;
+    if (!f) {
+        return LZW_OPEN_SRC_ERROR;
+    }
+
+    uint8_t *buf = malloc(COPY_BUF_SIZE);
+    if (!buf) {
+        fclose(f);
+        return LZW_HEAP_ERROR;
+    }
+
+    struct sha256 sha;
+    sha256_init(&sha);
+
+    size_t n;
+    while ((n = fread(buf, sizeof(uint8_t), COPY_BUF_SIZE, f)) > 0) {
+        sha256_update(&sha, buf, n);
+    }
+
+    bool read_error = ferror(f);
+    free(buf);
+    fclose(f);
+
+    if (read_error) {
+        return LZW_READ_ERROR;
+    }
+
+    sha256_final(&sha, digest);
+    return LZW_OKAY;
+}
+
+/**
+ * Decompresses the source into a newly created temporary file in the cache
+ * directory, whose path is placed into `tmp_path` (of `PATH_MAX` bytes). The
+ * temporary file is removed if decompression fails.
+ * @return `enum lzw_error` error code.
+ */
+static enum lzw_error decompress_to_tmp(
+        struct lzw_cache *cache,
+        char *src_name,
+        bool sparse,
+        char *tmp_path
+) {
+    int n = snprintf(tmp_path, PATH_MAX, "%s/" TMP_PREFIX "XXXXXX",
+                     cache->dir);
+    if (n < 0 || n >= PATH_MAX) {
+        return LZW_CACHE_ERROR;
+    }
+
+    int tmp_fd = mkstemp(tmp_path);
+    if (tmp_fd < 0) {
+        return LZW_CACHE_ERROR;
+    }
+
+    // `mkstemp` creates the file readable only by its owner.
+    int chmod_result = fchmod(tmp_fd, ENTRY_MODE);
+    close(tmp_fd);
+    if (chmod_result != 0) {
+        unlink(tmp_path);
+        return LZW_CACHE_ERROR;
+    }
+
+    struct lzw_decompressor lzw;
+    enum lzw_error error = lzw_init(&lzw, src_name, tmp_path);
+
+    if (!lzw_has_error(error)) {
+        lzw.sparse = sparse;
+        error = lzw_decompress(&lzw);
+        lzw_deinit(&lzw);
+    }
+
+    if (lzw_has_error(error)) {
+        unlink(tmp_path);
+    }
+
+    return error;
+}
+
+/**
+ * Writes the contents of the open cache entry to the destination file.
+ * Clones the entry if the filesystem supports it, otherwise copies it,
+ * leaving holes for all-zero blocks if `sparse` is set.
+ * @return `enum lzw_error` error code.
+ */
+static enum lzw_error serve_entry(int entry_fd, char *dst_name, bool sparse) {
+    int dst_fd = dst_name ?
+                 open(dst_name, O_WRONLY | O_CREAT | O_TRUNC, 0666) : -1;
+    if (dst_fd < 0) {
+        return LZW_OPEN_DST_ERROR;
+    }
+
+#ifdef FICLONE
+    // A clone shares the entry's blocks, so is as sparse as the entry.
+    if (ioctl(dst_fd, FICLONE, entry_fd) == 0) {
+        return close(dst_fd) == 0 ? LZW_OKAY : LZW_WRITE_DST_ERROR;
+    }
+#endif
+
+    // As in `lzw_decompress`, holes can only be left in regular files.
+    struct stat st;
+    if (sparse && (fstat(dst_fd, &st) != 0 || !S_ISREG(st.st_mode))) {
+        sparse = false;
+    }
+
+    enum lzw_error error = copy_entry(entry_fd, dst_fd, sparse);
+
+    if (close(dst_fd) != 0 && !lzw_has_error(error)) {
+        error = LZW_WRITE_DST_ERROR;
+    }
+
+    return error;
+}
+
+/**
+ * Copies the open cache entry into the open destination file. If `sparse`
+ * is set, seeks past blocks of `LZW_SPARSE_BLOCK_SIZE` zeros instead of
+ * writing them, then sets the final size with `ftruncate`.
+ * @return `enum lzw_error` error code.
+ */
+static enum lzw_error copy_entry(int entry_fd, int dst_fd, bool sparse) {
+    uint8_t *buf = malloc(COPY_BUF_SIZE);
+    if (!buf) {
+        return LZW_HEAP_ERROR;
+    }
+
+    enum lzw_error error = LZW_OKAY;
+    off_t total = 0;
+    ssize_t n;
+
+    while (!lzw_has_error(error) &&
+           (n = read(entry_fd, buf, COPY_BUF_SIZE)) > 0) {
+        for (ssize_t off = 0; off < n; off += LZW_SPARSE_BLOCK_SIZE) {
+            size_t len = (size_t) (n - off) < LZW_SPARSE_BLOCK_SIZE ?
+                         (size_t) (n - off) : LZW_SPARSE_BLOCK_SIZE;
+            const uint8_t *block = &buf[off];
+
+            bool hole = sparse && lzw_is_all_zero(block, len);
+
+            bool ok = hole ?
+                      lseek(dst_fd, (off_t) len, SEEK_CUR) >= 0 :
+                      write(dst_fd, block, len) == (ssize_t) len;
+            if (!ok) {
+                error = LZW_WRITE_DST_ERROR;
+                break;
+            }
+
+            total += (off_t) len;
+        }
+    }
+
+    if (!lzw_has_error(error) && n < 0) {
+        error = LZW_CACHE_ERROR;
+    }
+
+    if (!lzw_has_error(error) && sparse && ftruncate(dst_fd, total) != 0) {
+        error = LZW_WRITE_DST_ERROR;
+    }
+
+    free(buf);
+
+    return error;
+}
+
+/**
+ * Removes the least recently used entries from the cache until the total
+ * size of the entries is within `cache->max_size`. Never removes the entry
+ * named `keep`, the one just published, even if it alone is over the bound.
+ * Also removes stale temporary files. Files with any other name are left
+ * alone.
+ *
+ * Other processes may be evicting at the same time, so entries that have
+ * already gone are ignored. Failing to evict is not an error, the cache is
+ * just left larger than it should be.
+ */
+static void evict(struct lzw_cache *cache, const char *keep) {
+    assert(cache);
+
+    DIR *dir = opendir(cache->dir);
+    if (!dir) {
+        return;
+    }
+
+    /* Gather the name, size, and last use of every entry. */
+
+    struct cache_file *files = NULL;
+    size_t num_files = 0;
+    size_t capacity = 0;
+    size_t total = 0;
+
+    int dir_fd = dirfd(dir);
+    time_t now = time(NULL);
+    struct dirent *ent;
+
+    while ((ent = readdir(dir))) {
+        bool is_tmp = strncmp(ent->d_name, TMP_PREFIX,
+                              strlen(TMP_PREFIX)) == 0;
+
+        // Remove stamps whose entries have been evicted.
+        if (strncmp(ent->d_name, STAMP_PREFIX, strlen(STAMP_PREFIX)) == 0) {
+            const char *stamped = ent->d_name + strlen(STAMP_PREFIX);
+            if (is_entry_name(stamped) &&
+                faccessat(dir_fd, stamped, F_OK, 0) != 0 && errno == ENOENT) {
+                unlinkat(dir_fd, ent->d_name, 0);
+            }
+            continue;
+        }
+
+        if (!is_tmp && !is_entry_name(ent->d_name)) {
+            continue;
+        }
+
+        struct stat st;
+        if (fstatat(dir_fd, ent->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0 ||
+            !S_ISREG(st.st_mode)) {
+            continue;
+        }
+
+        // Only remove temporary files old enough that their writer died.
+        if (is_tmp) {
+            if (now - st.st_mtim.tv_sec > STALE_TMP_SEC) {
+                unlinkat(dir_fd, ent->d_name, 0);
+            }
+            continue;
+        }
+
+        if (num_files == capacity) {
+            capacity = capacity ? capacity * 2 : 16;
+            struct cache_file *grown =
+                    realloc(files, sizeof(struct cache_file) * capacity);
+            if (!grown) {
+                break;
+            }
+            files = grown;
+        }
+
+        struct cache_file *file = &files[num_files++];
+        strncpy(file->name, ent->d_name, NAME_MAX);
+        file->name[NAME_MAX] = '\0';
+        file->size = st.st_size;
+        file->last_use = st.st_mtim;
+
+        char stamp_name[STAMP_NAME_SIZE];
+        get_stamp_name(ent->d_name, stamp_name);
+
+        struct stat stamp_st;
+        if (fstatat(dir_fd, stamp_name, &stamp_st, AT_SYMLINK_NOFOLLOW) == 0 &&
+            compare_times(&stamp_st.st_mtim, &file->last_use) > 0) {
+            file->last_use = stamp_st.st_mtim;
+        }
+
+        total += (size_t) st.st_size;
+    }
+
+    /* Remove the oldest entries until within the bound. */
+
+    if (total > cache->max_size) {
+        qsort(files, num_files, sizeof(struct cache_file),
+              compare_by_last_use);
+
+        for (size_t i = 0; i < num_files && total > cache->max_size; i++) {
+            if (strcmp(files[i].name, keep) == 0) {
+                continue;
+            }
+            if (unlinkat(dir_fd, files[i].name, 0) == 0 || errno == ENOENT) {
+                total -= (size_t) files[i].size;
+
+                char stamp_name[STAMP_NAME_SIZE];
+                get_stamp_name(files[i].name, stamp_name);
+                unlinkat(dir_fd, stamp_name, 0);
+            }
+        }
+    }
+
+    free(files);
+    closedir(dir);
+}
+
+/**
+ * Records a use of an entry owned by another user, whose modification time
+ * cannot be bumped, by atomically replacing its stamp with a new file. This
+ * only needs write access to the cache directory, which publishing entries
+ * needs anyway, unless the directory is sticky (like `/tmp`), in which case
+ * the stamp of another user cannot be replaced either. Failing to record a
+ * use is not an error, the entry is just evicted sooner than it should be.
+ */
+static void stamp_entry(struct lzw_cache *cache, const char *entry_name) {
+    char tmp_path[PATH_MAX];
+    int n = snprintf(tmp_path, sizeof(tmp_path), "%s/" TMP_PREFIX "XXXXXX",
+                     cache->dir);
+
+    char stamp_name[STAMP_NAME_SIZE];
+    get_stamp_name(entry_name, stamp_name);
+
+    char stamp_path[PATH_MAX];
+    int m = snprintf(stamp_path, sizeof(stamp_path), "%s/%s",
+                     cache->dir, stamp_name);
+
+    if (n < 0 || (size_t) n >= sizeof(tmp_path) ||
+        m < 0 || (size_t) m >= sizeof(stamp_path)) {
+        return;
+    }
+
+    int tmp_fd = mkstemp(tmp_path);
+    if (tmp_fd < 0) {
+        return;
+    }
+    close(tmp_fd);
+
+    if (rename(tmp_path, stamp_path) != 0) {
+        unlink(tmp_path);
+    }
+}
+
+/**
+ * Places the name of the stamp of the entry with the given name, which must
+ * be an entry name (see `is_entry_name`), into `stamp_name` (of
+ * `STAMP_NAME_SIZE` bytes).
+ */
+static void get_stamp_name(
+        const char *entry_name,
+        char *stamp_name
+) {
+    snprintf(stamp_name, STAMP_NAME_SIZE, STAMP_PREFIX "%.*s",
+             SHA256_DIGEST_SIZE * 2, entry_name);
+}
+
+/**
+ * Orders `struct cache_file`s from least to most recently used.
+ */
+static int compare_by_last_use(const void *a, const void *b) {
+    return compare_times(&((const struct cache_file *) a)->last_use,
+                         &((const struct cache_file *) b)->last_use);
+}
+
+/**
+ * Compares two times to the nanosecond, as entries used within the same
+ * second are common.
+ * @return Negative if `a` is earlier, positive if later, 0 if equal.
+ */
+static int compare_times(const struct timespec *a, const struct timespec *b) {
+    if (a->tv_sec != b->tv_sec) {
+        return (a->tv_sec > b->tv_sec) - (a->tv_sec < b->tv_sec);
+    }
+    return (a->tv_nsec > b->tv_nsec) - (a->tv_nsec < b->tv_nsec);
+}
@@ -0,0 +1,25 @@
+#ifndef LZW_COMPRESSION_LZW_CACHE_H
+#define LZW_COMPRESSION_LZW_CACHE_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include "lzw_decompressor.h"
+
+/*
+ * On-disk cache of decompressed files, keyed by a hash of the compressed
+ * input. Each entry is a single file in `dir`, so the cache can be shared
+ * between processes. See `lzw_cache_decompress` in .c for more info.
+ */
+struct lzw_cache {
+    char *dir;                 // Directory holding the cached entries.
+    size_t max_size;           // Bound on the total size of entries, in bytes.
+};
+
+enum lzw_error lzw_cache_decompress(
+        struct lzw_cache *cache,
+        char *src_name,
+        char *dst_name,
+        bool sparse
+);
+
+#endif //LZW_COMPRESSION_LZW_CACHE_H
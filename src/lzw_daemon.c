@@ -0,0 +1,1181 @@
+/* Needed for `fopencookie`, `accept4` and `pthread_setaffinity_np`. */
+#define _GNU_SOURCE
+
+#include <stddef.h>
+#include <stdint.h>
+#include <assert.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include "lzw_daemon.h"
+
+
+/**************************   Prototypes   ************************************/
+
+
+struct connection;
+struct job;
+struct job_queue;
+
+static bool is_stale_socket(struct sockaddr_un *addr);
+
+static enum lzw_error dispatch(int listener, struct job_queue *queue);
+
+static struct connection *accept_connection(int listener);
+
+static bool read_requests(struct connection *conn, struct job_queue *queue);
+
+static ssize_t recv_request_part(struct connection *conn);
+
+static bool start_request(struct connection *conn);
+
+static void drop_connection(struct connection *conn);
+
+static void release_connection(struct connection *conn);
+
+static void *worker_main(void *arg);
+
+static enum lzw_error run_fds_job(
+        struct lzw_decompressor *lzw,
+        struct job *job
+);
+
+static enum lzw_error run_inline_job(
+        struct lzw_decompressor *lzw,
+        struct job *job
+);
+
+static void discard_job(struct job *job);
+
+static ssize_t stream_write(void *cookie, const char *buf, size_t size);
+
+static bool send_fds_request(
+        int conn,
+        uint64_t id,
+        int src_fd,
+        int dst_fd,
+        bool sparse
+);
+
+static enum lzw_error recv_response(int conn, FILE *out);
+
+static bool send_frame(
+        struct connection *conn,
+        struct lzw_daemon_response *res,
+        const void *data
+);
+
+static bool send_final(
+        struct connection *conn,
+        uint64_t id,
+        enum lzw_error error
+);
+
+static bool send_all(int fd, const void *buf, size_t size);
+
+static bool recv_all(int fd, void *buf, size_t size);
+
+static void queue_push(struct job_queue *queue, struct job *job);
+
+static bool queue_pop(struct job_queue *queue, struct job *job);
+
+static void queue_stop(struct job_queue *queue);
+
+
+/****************************   Macros   **************************************/
+
+
+/* Number of received jobs that can wait for a free worker. */
+#define QUEUE_CAPACITY 64
+
+/* Size of the buffer that inline job output is streamed back in. */
+#define STREAM_BUF_SIZE (64 * 1024)
+
+/* Number of file descriptors passed with a `LZW_JOB_FDS` request. */
+#define NUM_JOB_FDS 2
+
+/* Number of connections the dispatcher first makes room for. */
+#define INITIAL_CONNECTIONS 16
+
+/*
+ * Longest a response frame may take to send, in seconds, so that a client
+ * that stops reading cannot hold a worker forever.
+ */
+#define SEND_TIMEOUT_SEC 30
+
+/*
+ * A client connection. The dispatcher receives requests from it, and the
+ * workers running its jobs send their responses over it.
+ */
+struct connection {
+    int fd;
+    atomic_int refs;           // One for the dispatcher, one per queued or
+                               // running job. Closed when it reaches 0.
+    pthread_mutex_t send_lock; // Held while sending a frame.
+
+    /* The request being received, only touched by the dispatcher. */
+    struct lzw_daemon_request req;
+    size_t req_len;            // Bytes of `req` received so far.
+    int fds[NUM_JOB_FDS];
+    int num_fds;               // Passed so far, may exceed `NUM_JOB_FDS`.
+    uint8_t *data;             // Inline data, `req.size` bytes.
+    size_t data_len;           // Bytes of `data` received so far.
+};
+
+/*
+ * A fully received request, waiting for or being run by a worker.
+ */
+struct job {
+    struct connection *conn;
+    struct lzw_daemon_request req;
+    int fds[NUM_JOB_FDS];      // Owned, for `LZW_JOB_FDS` jobs.
+    uint8_t *data;             // Owned, for `LZW_JOB_INLINE` jobs.
+};
+
+/*
+ * Received jobs waiting to be run. The dispatcher pushes to it and the
+ * workers pop from it.
+ */
+struct job_queue {
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    struct job jobs[QUEUE_CAPACITY];
+    size_t head;               // Index of the oldest job.
+    size_t len;                // Number of jobs in the queue.
+    bool stopping;             // Set once no more jobs will be pushed.
+};
+
+struct worker {
+    pthread_t thread;
+    int cpu;                   // CPU to pin the worker to.
+    struct job_queue *queue;
+};
+
+/*
+ * `fopencookie` cookie that streams an inline job's output to its client.
+ */
+struct stream {
+    struct connection *conn;
+    uint64_t id;               // The job's id.
+};
+
+
+/****************************   Public API   **********************************/
+
+
+/**
+ * Runs the decompression daemon, listening on `daemon->socket_path`. Only
+ * returns if the daemon fails to start or can no longer accept connections.
+ *
+ * Each worker in the pool is pinned to its own CPU and keeps one
+ * decompressor warm for its lifetime, reusing it for every job with
+ * `lzw_reset`. The calling thread receives the requests of every connection
+ * and queues each job on its own, so the jobs of a batch are spread over the
+ * pool, and a client that is slow or idle never holds up a worker.
+ *
+ * @param daemon The daemon's configuration.
+ * @return The error that stopped the daemon.
+ */
+enum lzw_error lzw_daemon_run(struct lzw_daemon *daemon) {
+    assert(daemon);
+    assert(daemon->socket_path);
+
+    // Writing to a client that has gone away should fail the job, not kill
+    // the daemon.
+    signal(SIGPIPE, SIG_IGN);
+
+    /* Set up the listening socket. */
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(daemon->socket_path) >= sizeof(addr.sun_path)) {
+        return LZW_SOCKET_ERROR;
+    }
+    strcpy(addr.sun_path, daemon->socket_path);
+
+    // Non-blocking, so a connection that is aborted between `poll` and
+    // `accept` cannot stall the dispatcher.
+    int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                          0);
+    if (listener < 0) {
+        return LZW_SOCKET_ERROR;
+    }
+
+    // Replace the socket left behind by a daemon that has exited, but never
+    // that of one still running, or anything else at the path.
+    struct stat st;
+    if (lstat(daemon->socket_path, &st) == 0) {
+        if (!S_ISSOCK(st.st_mode) || !is_stale_socket(&addr) ||
+            unlink(daemon->socket_path) != 0) {
+            close(listener);
+            return LZW_SOCKET_ERROR;
+        }
+    }
+
+    if (bind(listener, (struct sockaddr *) &addr, sizeof(addr)) != 0 ||
+        listen(listener, SOMAXCONN) != 0) {
+        close(listener);
+        return LZW_SOCKET_ERROR;
+    }
+
+    /* Start the worker pool. */
+
+    long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (num_cpus < 1) {
+        num_cpus = 1;
+    }
+
+    int num_workers = daemon->num_workers > 0 ?
+                      daemon->num_workers : (int) num_cpus;
+
+    struct job_queue queue = {
+            .lock = PTHREAD_MUTEX_INITIALIZER,
+            .not_empty = PTHREAD_COND_INITIALIZER,
+            .not_full = PTHREAD_COND_INITIALIZER,
+            .head = 0,
+            .len = 0,
+            .stopping = false
+    };
+
+    struct worker *workers = malloc(sizeof(struct worker) * num_workers);
+    if (!workers) {
+        close(listener);
+        return LZW_HEAP_ERROR;
+    }
+
+    enum lzw_error error = LZW_OKAY;
+
+    int num_started = 0;
+    for (; num_started < num_workers; num_started++) {
+        workers[num_started].cpu = (int) (num_started % num_cpus);
+        workers[num_started].queue = &queue;
+
+        if (pthread_create(&workers[num_started].thread, NULL, worker_main,
+                           &workers[num_started]) != 0) {
+            error = LZW_UNKNOWN_ERROR;
+            break;
+        }
+    }
+
+    /* Hand out jobs until accepting fails. */
+
+    if (!lzw_has_error(error)) {
+        error = dispatch(listener, &queue);
+    }
+
+    close(listener);
+
+    /* Let the workers finish the queued jobs, then wait for them to exit. */
+
+    queue_stop(&queue);
+
+    for (int i = 0; i < num_started; i++) {
+        pthread_join(workers[i].thread, NULL);
+    }
+
+    free(workers);
+    pthread_cond_destroy(&queue.not_full);
+    pthread_cond_destroy(&queue.not_empty);
+    pthread_mutex_destroy(&queue.lock);
+
+    return error;
+}
+
+/**
+ * Connects to a daemon listening on the given socket. The connection can be
+ * used for any number of jobs, and should be closed with `close` once done.
+ * @return The connected socket, or -1 on failure.
+ */
+int lzw_daemon_connect(char *socket_path) {
+    assert(socket_path);
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        return -1;
+    }
+    strcpy(addr.sun_path, socket_path);
+
+    int conn = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (conn < 0) {
+        return -1;
+    }
+
+    if (connect(conn, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+        close(conn);
+        return -1;
+    }
+
+    return conn;
+}
+
+/**
+ * Has the daemon decompress from `src_fd` into `dst_fd`. The file
+ * descriptors themselves are sent to the daemon, so it never has to open
+ * any paths. Waits for the job to finish.
+ * @param conn Connection from `lzw_daemon_connect`, with no jobs in flight.
+ * @param src_fd Source file, open for reading.
+ * @param dst_fd Destination file, open for writing.
+ * @param sparse Whether to write the destination sparsely.
+ * @return LZW_OKAY if successful, otherwise the error encountered.
+ */
+enum lzw_error lzw_daemon_decompress_fds(
+        int conn,
+        int src_fd,
+        int dst_fd,
+        bool sparse
+) {
+    struct lzw_daemon_job job = {
+            .src_fd = src_fd,
+            .dst_fd = dst_fd,
+            .sparse = sparse
+    };
+
+    enum lzw_error error = lzw_daemon_decompress_batch(conn, &job, 1);
+
+    return lzw_has_error(error) ? error : job.error;
+}
+
+/**
+ * Has the daemon decompress a batch of file descriptor jobs. Every job is
+ * sent before any response is awaited, so the daemon runs them in parallel
+ * across its pool. Waits for all of them to finish.
+ * @param conn Connection from `lzw_daemon_connect`, with no jobs in flight.
+ * @param jobs The jobs, each of whose `error` is set to its result.
+ * @param num_jobs Number of jobs.
+ * @return LZW_OKAY if every job was run, whether or not it succeeded.
+ * Otherwise LZW_SOCKET_ERROR, which is also the result of each job that did
+ * not get one.
+ */
+enum lzw_error lzw_daemon_decompress_batch(
+        int conn,
+        struct lzw_daemon_job *jobs,
+        size_t num_jobs
+) {
+    assert(jobs || num_jobs == 0);
+
+    for (size_t i = 0; i < num_jobs; i++) {
+        jobs[i].error = LZW_SOCKET_ERROR;
+    }
+
+    for (size_t i = 0; i < num_jobs; i++) {
+        if (!send_fds_request(conn, i, jobs[i].src_fd, jobs[i].dst_fd,
+                              jobs[i].sparse)) {
+            return LZW_SOCKET_ERROR;
+        }
+    }
+
+    /* Collect the results, in whatever order the jobs finish. */
+
+    for (size_t done = 0; done < num_jobs; done++) {
+        struct lzw_daemon_response res;
+
+        // File descriptor jobs send no output, so every frame is final.
+        if (!recv_all(conn, &res, sizeof(res)) || !res.last ||
+            res.id >= num_jobs) {
+            return LZW_SOCKET_ERROR;
+        }
+
+        jobs[res.id].error = (enum lzw_error) res.error;
+    }
+
+    return LZW_OKAY;
+}
+
+/**
+ * Has the daemon decompress the given bytes, writing the output it streams
+ * back into `out`. Waits for the job to finish.
+ * @param conn Connection from `lzw_daemon_connect`, with no jobs in flight.
+ * @param src The compressed bytes.
+ * @param size Number of compressed bytes, at most `LZW_DAEMON_MAX_INLINE`.
+ * @param out File to write the decompressed output to.
+ * @return LZW_OKAY if successful, otherwise the error encountered.
+ */
+enum lzw_error lzw_daemon_decompress_inline(
+        int conn,
+        const uint8_t *src,
+        size_t size,
+        FILE *out
+) {
+    assert(src || size == 0);
+    assert(out);
+
+    struct lzw_daemon_request req = {
+            .type = LZW_JOB_INLINE,
+            .flags = 0,
+            .id = 0,
+            .size = size
+    };
+
+    if (!send_all(conn, &req, sizeof(req)) || !send_all(conn, src, size)) {
+        return LZW_SOCKET_ERROR;
+    }
+
+    return recv_response(conn, out);
+}
+
+
+/*****************************   Helpers   ************************************/
+
+
+/**
+ * Checks whether the socket at the given address was left behind by a daemon
+ * that has exited, by trying to connect to it.
+ * @return true if nothing is listening on the socket, false if something is
+ * or it could not be told.
+ */
+static bool is_stale_socket(struct sockaddr_un *addr) {
+    int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (probe < 0) {
+        return false;
+    }
+
+    bool refused = connect(probe, (struct sockaddr *) addr,
+                           sizeof(*addr)) != 0 && errno == ECONNREFUSED;
+
+    close(probe);
+
+    return refused;
+}
+
+/**
+ * Accepts connections and receives their requests, queueing each complete
+ * request as a job. Connections are read without blocking, so a client that
+ * sends slowly does not hold up the others.
+ * @return The error that stopped the dispatcher.
+ */
+static enum lzw_error dispatch(int listener, struct job_queue *queue) {
+    struct connection **conns = NULL;
+    struct pollfd *pfds = NULL;
+    size_t num_conns = 0;
+    size_t capacity = 0;
+    enum lzw_error error = LZW_OKAY;
+
+    while (!lzw_has_error(error)) {
+        // Keep room for one more, so a connection can always be accepted.
+        if (num_conns == capacity) {
+            size_t new_capacity = capacity ?
+                                  capacity * 2 : INITIAL_CONNECTIONS;
+
+            struct connection **new_conns = realloc(
+                    conns, sizeof(*conns) * new_capacity
+            );
+            if (new_conns) {
+                conns = new_conns;
+            }
+
+            // One more for the listener.
+            struct pollfd *new_pfds = realloc(
+                    pfds, sizeof(*pfds) * (new_capacity + 1)
+            );
+            if (new_pfds) {
+                pfds = new_pfds;
+            }
+
+            if (!new_conns || !new_pfds) {
+                error = LZW_HEAP_ERROR;
+                break;
+            }
+
+            capacity = new_capacity;
+        }
+
+        pfds[0].fd = listener;
+        pfds[0].events = POLLIN;
+        for (size_t i = 0; i < num_conns; i++) {
+            pfds[i + 1].fd = conns[i]->fd;
+            pfds[i + 1].events = POLLIN;
+        }
+
+        if (poll(pfds, num_conns + 1, -1) < 0) {
+            if (errno != EINTR) {
+                error = LZW_SOCKET_ERROR;
+            }
+            continue;
+        }
+
+        /* Receive what has arrived, dropping closed or broken connections. */
+
+        size_t kept = 0;
+        for (size_t i = 0; i < num_conns; i++) {
+            if (pfds[i + 1].revents == 0 || read_requests(conns[i], queue)) {
+                conns[kept++] = conns[i];
+            } else {
+                drop_connection(conns[i]);
+            }
+        }
+        num_conns = kept;
+
+        /* Accept a new connection. */
+
+        if (pfds[0].revents & POLLIN) {
+            struct connection *conn = accept_connection(listener);
+
+            if (conn) {
+                conns[num_conns++] = conn;
+            } else if (errno != EINTR && errno != ECONNABORTED &&
+                       errno != EAGAIN && errno != ENOMEM) {
+                error = LZW_SOCKET_ERROR;
+            }
+        }
+    }
+
+    for (size_t i = 0; i < num_conns; i++) {
+        drop_connection(conns[i]);
+    }
+    free(conns);
+    free(pfds);
+
+    return error;
+}
+
+/**
+ * Accepts a connection on the listening socket.
+ * @return The new connection, or NULL with `errno` set on failure.
+ */
+static struct connection *accept_connection(int listener) {
+    int fd = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    struct timeval timeout = {.tv_sec = SEND_TIMEOUT_SEC, .tv_usec = 0};
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    struct connection *conn = calloc(1, sizeof(*conn));
+    if (!conn) {
+        close(fd);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    conn->fd = fd;
+    atomic_init(&conn->refs, 1);
+    pthread_mutex_init(&conn->send_lock, NULL);
+
+    return conn;
+}
+
+/**
+ * Receives as much as has arrived on the connection without blocking,
+ * queueing a job for each request that is complete.
+ * @return true if the connection is still usable, false if the client closed
+ * it or it is broken.
+ */
+static bool read_requests(struct connection *conn, struct job_queue *queue) {
+    assert(conn);
+
+    struct lzw_daemon_request *req = &conn->req;
+
+    for (;;) {
+        ssize_t n;
+
+        if (conn->req_len < sizeof(*req)) {
+            n = recv_request_part(conn);
+        } else if (req->type == LZW_JOB_INLINE && conn->data_len < req->size) {
+            n = recv(conn->fd, conn->data + conn->data_len,
+                     (size_t) req->size - conn->data_len, MSG_DONTWAIT);
+        } else {
+            /* The request is complete, hand it to the workers. */
+
+            struct job job = {
+                    .conn = conn,
+                    .req = *req,
+                    .fds = {conn->fds[0], conn->fds[1]},
+                    .data = conn->data
+            };
+
+            atomic_fetch_add(&conn->refs, 1);
+            queue_push(queue, &job);
+
+            conn->req_len = 0;
+            conn->num_fds = 0;
+            conn->data = NULL;
+            conn->data_len = 0;
+            continue;
+        }
+
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return true;
+        }
+        if (n <= 0) {
+            return false;
+        }
+
+        if (conn->req_len < sizeof(*req)) {
+            conn->req_len += (size_t) n;
+
+            if (conn->req_len == sizeof(*req) && !start_request(conn)) {
+                return false;
+            }
+        } else {
+            conn->data_len += (size_t) n;
+        }
+    }
+}
+
+/**
+ * Receives more of the connection's request header without blocking, taking
+ * any file descriptors passed with it.
+ * @return As `recv`. -1 with `errno` EPROTO if descriptors were lost.
+ */
+static ssize_t recv_request_part(struct connection *conn) {
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * NUM_JOB_FDS)];
+        struct cmsghdr align;
+    } control;
+
+    struct iovec iov = {
+            .iov_base = (uint8_t *) &conn->req + conn->req_len,
+            .iov_len = sizeof(conn->req) - conn->req_len
+    };
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    ssize_t n = recvmsg(conn->fd, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+    if (n <= 0) {
+        return n;
+    }
+
+    /* Take any passed file descriptors, so they are never leaked. */
+
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+         cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+            continue;
+        }
+
+        size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+
+        for (size_t i = 0; i < count; i++) {
+            int fd;
+            memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+
+            // Extra descriptors are closed, but still counted so that the
+            // request is rejected.
+            if (conn->num_fds < NUM_JOB_FDS) {
+                conn->fds[conn->num_fds] = fd;
+            } else {
+                close(fd);
+            }
+            conn->num_fds += 1;
+        }
+    }
+
+    if (msg.msg_flags & MSG_CTRUNC) {
+        errno = EPROTO;
+        return -1;
+    }
+
+    return n;
+}
+
+/**
+ * Checks a fully received request header, and prepares to receive the
+ * request's inline data. Whatever follows a malformed request cannot be made
+ * sense of, so the connection has to be dropped.
+ * @return true if the request is valid, false if the connection must be
+ * dropped.
+ */
+static bool start_request(struct connection *conn) {
+    struct lzw_daemon_request *req = &conn->req;
+
+    bool fds_valid = req->type == LZW_JOB_FDS ?
+                     conn->num_fds == NUM_JOB_FDS : conn->num_fds == 0;
+    if (!fds_valid) {
+        return false;
+    }
+
+    if (req->type == LZW_JOB_FDS) {
+        return true;
+    }
+
+    if (req->type != LZW_JOB_INLINE) {
+        send_final(conn, req->id, LZW_UNKNOWN_ERROR);
+        return false;
+    }
+
+    // Refuse sizes that cannot be buffered.
+    if (req->size == 0 || req->size > LZW_DAEMON_MAX_INLINE) {
+        send_final(conn, req->id, LZW_INVALID_FORMAT_ERROR);
+        return false;
+    }
+
+    conn->data = malloc((size_t) req->size);
+    if (!conn->data) {
+        send_final(conn, req->id, LZW_HEAP_ERROR);
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * Stops receiving from the connection, discarding any partly received
+ * request. The connection is closed once its queued jobs have finished.
+ */
+static void drop_connection(struct connection *conn) {
+    int num_fds = conn->num_fds < NUM_JOB_FDS ? conn->num_fds : NUM_JOB_FDS;
+    for (int i = 0; i < num_fds; i++) {
+        close(conn->fds[i]);
+    }
+
+    free(conn->data);
+    conn->data = NULL;
+
+    release_connection(conn);
+}
+
+/**
+ * Drops a reference to the connection, closing it if it was the last.
+ */
+static void release_connection(struct connection *conn) {
+    if (atomic_fetch_sub(&conn->refs, 1) == 1) {
+        close(conn->fd);
+        pthread_mutex_destroy(&conn->send_lock);
+        free(conn);
+    }
+}
+
+/**
+ * Entry point of a worker thread. Pins itself to its CPU, warms up a
+ * decompressor, then runs jobs from the queue until it is stopped.
+ */
+static void *worker_main(void *arg) {
+    struct worker *worker = arg;
+    assert(worker);
+
+#ifdef __linux__
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(worker->cpu, &cpus);
+    // Not being pinned only costs some cache warmth, so ignore failure.
+    pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+#endif
+
+    // Files are given per job with `lzw_reset`.
+    struct lzw_decompressor lzw;
+    enum lzw_error init_error = lzw_init_files(&lzw, NULL, NULL);
+
+    struct job job;
+    while (queue_pop(worker->queue, &job)) {
+        enum lzw_error error;
+
+        // Without a decompressor no jobs can be run, so fail them.
+        if (lzw_has_error(init_error)) {
+            discard_job(&job);
+            error = init_error;
+        } else if (job.req.type == LZW_JOB_FDS) {
+            error = run_fds_job(&lzw, &job);
+        } else {
+            error = run_inline_job(&lzw, &job);
+        }
+
+        send_final(job.conn, job.req.id, error);
+        release_connection(job.conn);
+    }
+
+    if (!lzw_has_error(init_error)) {
+        lzw_deinit(&lzw);
+    }
+
+    return NULL;
+}
+
+/**
+ * Decompresses between the two file descriptors of a `LZW_JOB_FDS` job.
+ * Takes ownership of the file descriptors.
+ * @return `enum lzw_error` error code.
+ */
+static enum lzw_error run_fds_job(
+        struct lzw_decompressor *lzw,
+        struct job *job
+) {
+    assert(lzw);
+    assert(job);
+
+    FILE *src = fdopen(job->fds[0], "rb");
+    FILE *dst = fdopen(job->fds[1], "wb");
+
+    if (!src || !dst) {
+        if (src) {
+            fclose(src);
+        } else {
+            close(job->fds[0]);
+        }
+
+        if (dst) {
+            fclose(dst);
+        } else {
+            close(job->fds[1]);
+        }
+
+        return src ? LZW_OPEN_DST_ERROR : LZW_OPEN_SRC_ERROR;
+    }
+
+    lzw_reset(lzw, src, dst);
+    lzw->sparse = job->req.flags & LZW_JOB_SPARSE;
+
+    enum lzw_error error = lzw_decompress(lzw);
+
+    // Release the files now, so the output is flushed before replying.
+    enum lzw_error close_error = lzw_reset(lzw, NULL, NULL);
+
+    return lzw_has_error(error) ? error : close_error;
+}
+
+/**
+ * Decompresses the data of a `LZW_JOB_INLINE` job, streaming the output back
+ * over the job's connection. Takes ownership of the data.
+ * @return `enum lzw_error` error code.
+ */
+static enum lzw_error run_inline_job(
+        struct lzw_decompressor *lzw,
+        struct job *job
+) {
+    assert(lzw);
+    assert(job);
+
+    /* Read from the buffer and write straight back to the client. */
+
+    cookie_io_functions_t stream_funcs = {
+            .read = NULL,
+            .write = stream_write,
+            .seek = NULL,
+            .close = NULL
+    };
+
+    struct stream stream = {.conn = job->conn, .id = job->req.id};
+
+    FILE *src = fmemopen(job->data, (size_t) job->req.size, "rb");
+    FILE *dst = fopencookie(&stream, "wb", stream_funcs);
+
+    enum lzw_error error = LZW_OKAY;
+    if (!src || !dst) {
+        error = src ? LZW_OPEN_DST_ERROR : LZW_OPEN_SRC_ERROR;
+    } else {
+        setvbuf(dst, NULL, _IOFBF, STREAM_BUF_SIZE);
+    }
+
+    // Hand the files over even on error, so they get closed.
+    lzw_reset(lzw, src, dst);
+
+    if (!lzw_has_error(error)) {
+        error = lzw_decompress(lzw);
+    }
+
+    // Flushes the last of the output to the client.
+    enum lzw_error close_error = lzw_reset(lzw, NULL, NULL);
+
+    free(job->data);
+
+    return lzw_has_error(error) ? error : close_error;
+}
+
+/**
+ * Releases the file descriptors or data of a job that will not be run.
+ */
+static void discard_job(struct job *job) {
+    if (job->req.type == LZW_JOB_FDS) {
+        close(job->fds[0]);
+        close(job->fds[1]);
+    } else {
+        free(job->data);
+    }
+}
+
+/**
+ * `fopencookie` write function that sends the written bytes to the client as
+ * a non-final response frame of the job whose `struct stream` is `cookie`.
+ */
+static ssize_t stream_write(void *cookie, const char *buf, size_t size) {
+    struct stream *stream = cookie;
+
+    struct lzw_daemon_response res = {
+            .error = LZW_OKAY,
+            .last = 0,
+            .id = stream->id,
+            .size = size
+    };
+
+    if (!send_frame(stream->conn, &res, buf)) {
+        return -1;
+    }
+
+    return (ssize_t) size;
+}
+
+/**
+ * Sends a `LZW_JOB_FDS` request with the file descriptors attached.
+ * @return true if sent, false otherwise.
+ */
+static bool send_fds_request(
+        int conn,
+        uint64_t id,
+        int src_fd,
+        int dst_fd,
+        bool sparse
+) {
+    struct lzw_daemon_request req = {
+            .type = LZW_JOB_FDS,
+            .flags = sparse ? LZW_JOB_SPARSE : 0,
+            .id = id,
+            .size = 0
+    };
+
+    struct iovec iov = {.iov_base = &req, .iov_len = sizeof(req)};
+
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * NUM_JOB_FDS)];
+        struct cmsghdr align;
+    } control;
+    memset(&control, 0, sizeof(control));
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * NUM_JOB_FDS);
+
+    int fds[NUM_JOB_FDS] = {src_fd, dst_fd};
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    ssize_t sent;
+    do {
+        sent = sendmsg(conn, &msg, MSG_NOSIGNAL);
+    } while (sent < 0 && errno == EINTR);
+
+    if (sent < 0) {
+        return false;
+    }
+
+    // The descriptors went with the first byte, send whatever is left.
+    return send_all(conn, (uint8_t *) &req + sent, sizeof(req) - sent);
+}
+
+/**
+ * Receives response frames until the final one, writing any output to `out`.
+ * @param out File to write output to, may be NULL if no output is expected.
+ * @return The job's error, or LZW_SOCKET_ERROR if the response could not be
+ * received.
+ */
+static enum lzw_error recv_response(int conn, FILE *out) {
+    struct lzw_daemon_response res;
+    uint8_t buf[STREAM_BUF_SIZE];
+    enum lzw_error error = LZW_OKAY;
+
+    for (;;) {
+        if (!recv_all(conn, &res, sizeof(res))) {
+            return LZW_SOCKET_ERROR;
+        }
+
+        if (res.last) {
+            break;
+        }
+
+        // Keep draining output after a write error, so that the connection
+        // is left ready for the next job.
+        uint64_t remaining = res.size;
+        while (remaining > 0) {
+            size_t n = remaining < sizeof(buf) ? remaining : sizeof(buf);
+
+            if (!recv_all(conn, buf, n)) {
+                return LZW_SOCKET_ERROR;
+            }
+
+            if (!out || fwrite(buf, sizeof(uint8_t), n, out) != n) {
+                error = LZW_WRITE_DST_ERROR;
+            }
+
+            remaining -= n;
+        }
+    }
+
+    return lzw_has_error((enum lzw_error) res.error) ?
+           (enum lzw_error) res.error : error;
+}
+
+/**
+ * Sends a response frame followed by its `res->size` bytes of `data`, without
+ * interleaving with frames sent by other workers. A frame sent in part leaves
+ * the stream corrupt, so if sending fails the connection is shut down.
+ * @return true if sent, false otherwise.
+ */
+static bool send_frame(
+        struct connection *conn,
+        struct lzw_daemon_response *res,
+        const void *data
+) {
+    pthread_mutex_lock(&conn->send_lock);
+
+    bool sent = send_all(conn->fd, res, sizeof(*res)) &&
+                send_all(conn->fd, data, (size_t) res->size);
+    if (!sent) {
+        shutdown(conn->fd, SHUT_RDWR);
+    }
+
+    pthread_mutex_unlock(&conn->send_lock);
+
+    return sent;
+}
+
+/**
+ * Sends the final response frame of a job.
+ * @return true if sent, false otherwise.
+ */
+static bool send_final(
+        struct connection *conn,
+        uint64_t id,
+        enum lzw_error error
+) {
+    struct lzw_daemon_response res = {
+            .error = (uint32_t) error,
+            .last = 1,
+            .id = id,
+            .size = 0
+    };
+
+    return send_frame(conn, &res, NULL);
+}
+
+/**
+ * Sends exactly `size` bytes.
+ * @return true if all bytes were sent, false otherwise.
+ */
+static bool send_all(int fd, const void *buf, size_t size) {
+    const uint8_t *bytes = buf;
+
+    while (size > 0) {
+        ssize_t n = send(fd, bytes, size, MSG_NOSIGNAL);
+
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+
+        bytes += n;
+        size -= (size_t) n;
+    }
+
+    return true;
+}
+
+/**
+ * Receives exactly `size` bytes.
+ * @return true if all bytes were received, false otherwise (including if
+ * the connection was closed first).
+ */
+static bool recv_all(int fd, void *buf, size_t size) {
+    uint8_t *bytes = buf;
+
+    while (size > 0) {
+        ssize_t n = recv(fd, bytes, size, 0);
+
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+
+        bytes += n;
+        size -= (size_t) n;
+    }
+
+    return true;
+}
+
+/**
+ * Adds a job to the queue, waiting for space if it is full.
+ */
+static void queue_push(struct job_queue *queue, struct job *job) {
+    assert(queue);
+    assert(job);
+
+    pthread_mutex_lock(&queue->lock);
+
+    while (queue->len == QUEUE_CAPACITY) {
+        pthread_cond_wait(&queue->not_full, &queue->lock);
+    }
+
+    queue->jobs[(queue->head + queue->len) % QUEUE_CAPACITY] = *job;
+    queue->len += 1;
+
+    pthread_cond_signal(&queue->not_empty);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+/**
+ * Takes the oldest job from the queue, waiting for one if it is empty.
+ * @return true if a job was taken, false if the queue is empty and stopped.
+ */
+static bool queue_pop(struct job_queue *queue, struct job *job) {
+    assert(queue);
+    assert(job);
+
+    pthread_mutex_lock(&queue->lock);
+
+    while (queue->len == 0 && !queue->stopping) {
+        pthread_cond_wait(&queue->not_empty, &queue->lock);
+    }
+
+    if (queue->len == 0) {
+        pthread_mutex_unlock(&queue->lock);
+        return false;
+    }
+
+    *job = queue->jobs[queue->head];
+    queue->head = (queue->head + 1) % QUEUE_CAPACITY;
+    queue->len -= 1;
+
+    pthread_cond_signal(&queue->not_full);
+    pthread_mutex_unlock(&queue->lock);
+
+    return true;
+}
+
+/**
+ * Marks that no more jobs will be pushed, waking every waiting worker so
+ * that they exit once the queue is empty.
+ */
+static void queue_stop(struct job_queue *queue) {
+    assert(queue);
+
+    pthread_mutex_lock(&queue->lock);
+
+    queue->stopping = true;
+
+    pthread_cond_broadcast(&queue->not_empty);
+    pthread_mutex_unlock(&queue->lock);
+}
@@ -0,0 +1,92 @@
+#ifndef LZW_COMPRESSION_LZW_DAEMON_H
+#define LZW_COMPRESSION_LZW_DAEMON_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include "lzw_decompressor.h"
+
+/* Largest compressed input accepted in an inline job, 64 MiB. */
+#define LZW_DAEMON_MAX_INLINE ((uint64_t) 64 * 1024 * 1024)
+
+/* Request flag: write the destination of a file descriptor job sparsely. */
+#define LZW_JOB_SPARSE 0x1u
+
+enum lzw_job_type {
+    LZW_JOB_FDS,               // Source and destination file descriptors
+                               // are passed with the request (SCM_RIGHTS).
+    LZW_JOB_INLINE,            // `size` bytes of compressed data follow the
+                               // request, and the output is sent back.
+};
+
+/*
+ * Sent by the client for each job. A connection may send any number of jobs
+ * without waiting for their responses. Each job is run by whichever worker is
+ * free, so jobs on one connection run in parallel and may finish in any
+ * order.
+ */
+struct lzw_daemon_request {
+    uint32_t type;             // `enum lzw_job_type`.
+    uint32_t flags;            // Bitwise or of `LZW_JOB_*` flags.
+    uint64_t id;               // Chosen by the client, echoed in responses.
+    uint64_t size;             // Size of the inline data, 0 for fd jobs.
+};
+
+/*
+ * Sent by the daemon in reply to a job. Output of inline jobs is streamed
+ * back as frames with `last` false, each followed by `size` bytes of output.
+ * Every job ends with a frame with `last` true, holding the job's error.
+ * Frames of different jobs may be interleaved.
+ */
+struct lzw_daemon_response {
+    uint32_t error;            // `enum lzw_error`, only meaningful if last.
+    uint32_t last;             // Non-zero if this is the job's final frame.
+    uint64_t id;               // `id` of the job's request.
+    uint64_t size;             // Bytes of output following this frame.
+};
+
+/*
+ * A file descriptor job of a batch sent with `lzw_daemon_decompress_batch`.
+ */
+struct lzw_daemon_job {
+    int src_fd;                // Source file, open for reading.
+    int dst_fd;                // Destination file, open for writing.
+    bool sparse;               // Whether to write the destination sparsely.
+    enum lzw_error error;      // Set to the job's result.
+};
+
+struct lzw_daemon {
+    char *socket_path;         // Path of the Unix domain socket to listen on.
+    int num_workers;           // Size of worker pool, <= 0 for one per CPU.
+};
+
+enum lzw_error lzw_daemon_run(
+        struct lzw_daemon *daemon
+);
+
+int lzw_daemon_connect(
+        char *socket_path
+);
+
+enum lzw_error lzw_daemon_decompress_fds(
+        int conn,
+        int src_fd,
+        int dst_fd,
+        bool sparse
+);
+
+enum lzw_error lzw_daemon_decompress_batch(
+        int conn,
+        struct lzw_daemon_job *jobs,
+        size_t num_jobs
+);
+
+enum lzw_error lzw_daemon_decompress_inline(
+        int conn,
+        const uint8_t *src,
+        size_t size,
+        FILE *out
+);
+
+#endif //LZW_COMPRESSION_LZW_DAEMON_H
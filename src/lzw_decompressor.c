@@ -2,12 +2,18 @@
 #include <assert.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include "lzw_decompressor.h"
 
 
 /**************************   Prototypes   ************************************/
 
 
+static void reset_state(struct lzw_decompressor *lzw);
+
+static enum lzw_error close_files(struct lzw_decompressor *lzw);
+
 static enum lzw_error append_byte_and_add_to_dict(
         struct lzw_decompressor *lzw,
         struct dict_entry *entry,
@@ -15,15 +21,45 @@ static enum lzw_error append_byte_and_add_to_dict(
         struct dict_entry **new_entry
 );
 
+static enum lzw_error decode_chain(
+        struct lzw_decompressor *lzw,
+        struct dict_entry *last_entry,
+        int *last_code
+);
+
 static enum lzw_error write_next(
         struct lzw_decompressor *lzw,
         struct dict_entry *entry
 );
 
+static enum lzw_error write_bytes(
+        struct lzw_decompressor *lzw,
+        const uint8_t *bytes,
+        size_t size
+);
+
+static enum lzw_error flush_block(struct lzw_decompressor *lzw);
+
+static enum lzw_error finish_output(struct lzw_decompressor *lzw);
+
+static bool is_regular_file(FILE *f);
+
 static struct dict_entry *lookup_code(struct lzw_decompressor *lzw, int code);
 
 static bool read_next_code(struct lzw_decompressor *lzw, int *code);
 
+static void unread_code(struct lzw_decompressor *lzw, int code);
+
+static enum lzw_error load_codes(struct lzw_decompressor *lzw);
+
+static enum lzw_error read_all(FILE *f, uint8_t **bytes, size_t *size);
+
+static bool codes_in_bounds(
+        const uint16_t *codes,
+        size_t num_codes,
+        size_t capacity
+);
+
 
 /****************************   Macros   **************************************/
 
@@ -34,7 +70,7 @@ static bool read_next_code(struct lzw_decompressor *lzw, int *code);
  *     3. Add the corresponding error message to the below array, keeping the
  *        messages in the same order as the errors in the enum.
  */
-#define NUM_LZW_ERRORS 8
+#define NUM_LZW_ERRORS 10
 static char const *lzw_error_msgs[NUM_LZW_ERRORS] = {
         "Okay",
         "Unknown error",
@@ -43,7 +79,9 @@ static char const *lzw_error_msgs[NUM_LZW_ERRORS] = {
         "Heap error",
         "Failed to write to destination file",
         "Failed to read from the source file",
-        "File is not in a valid LZW-encoded format"
+        "File is not in a valid LZW-encoded format",
+        "Failed to access the cache directory",
+        "Failed to communicate over the daemon socket"
 };
 
 /**
@@ -82,6 +120,9 @@ static char const *lzw_error_msgs[NUM_LZW_ERRORS] = {
 #define HALF_BYTE_IN_BITS 4
 #define CLEAR_FIRST_HALF 0x0F
 
+/* Codes below this are single bytes, which are always in the dictionary. */
+#define NUM_BYTE_CODES 256
+
 #ifndef NDEBUG
 /**
  * Used for debugging, prints the bit pattern of the given byte and a new line.
@@ -106,8 +147,11 @@ void print_bin(uint8_t byte)
 /**
  * Initialises a new LZW decompressor. Takes input from a binary file and
  * writes decompressed output to a binary file.
+ *
+ * The destination is only opened (and so truncated) by `lzw_decompress`,
+ * once strict mode has validated the source, so a rejected source leaves an
+ * existing destination untouched.
  * @param lzw The lzw_decompressor to initialise.
- * @param code_length_bits The length in bits of the codes in the source.
  * @param src_name Path to the source file.
  * @param dst_name Path to the destination file.
  * @return LZW_OKAY if no error, otherwise the error encountered.
@@ -119,13 +163,47 @@ enum lzw_error lzw_init(
 ) {
     assert(lzw);
 
-    /* Open source and destination files. */
+    /* Open the source file, leaving the destination for `lzw_decompress`. */
+
+    lzw->dst = NULL;
 
     lzw->src = src_name ? fopen(src_name, "rb") : NULL;
     GUARD(!lzw->src, LZW_OPEN_SRC_ERROR, lzw);
 
-    lzw->dst = dst_name ? fopen(dst_name, "wb") : NULL;
-    GUARD(!lzw->dst, LZW_OPEN_DST_ERROR, lzw);
+    if (!dst_name) {
+        fclose(lzw->src);
+        lzw->src = NULL;
+    }
+    GUARD(!dst_name, LZW_OPEN_DST_ERROR, lzw);
+
+    enum lzw_error error = lzw_init_files(lzw, lzw->src, NULL);
+    lzw->dst_name = dst_name;
+
+    return error;
+}
+
+/**
+ * Initialises a new LZW decompressor on already opened files. The
+ * decompressor takes ownership of the files, closing them in `lzw_deinit`.
+ *
+ * Either file may be NULL, in which case one must be given with `lzw_reset`
+ * before decompressing. This allows a decompressor to be set up once and
+ * then reused for many files.
+ * @param lzw The lzw_decompressor to initialise.
+ * @param src Source file, opened for binary reading.
+ * @param dst Destination file, opened for binary writing.
+ * @return LZW_OKAY if no error, otherwise the error encountered.
+ */
+enum lzw_error lzw_init_files(
+        struct lzw_decompressor *lzw,
+        FILE *src,
+        FILE *dst
+) {
+    assert(lzw);
+
+    lzw->src = src;
+    lzw->dst = dst;
+    lzw->dst_name = NULL;
 
     /* Initialise dictionary. */
     bool dict_init_success = dict_init(&lzw->dict);
@@ -133,13 +211,46 @@ enum lzw_error lzw_init(
     // error due to failed malloc.
     GUARD(!dict_init_success, LZW_HEAP_ERROR, lzw);
 
-    /* Initialise odd to true, as next byte to be read is the first. */
-    lzw->odd = true;
+    reset_state(lzw);
 
     lzw->error = LZW_OKAY;
     return LZW_OKAY;
 }
 
+/**
+ * Closes the decompressor's current files and rebinds it to new ones, so it
+ * can decompress another file without reallocating its dictionary. Options
+ * such as `sparse` are reset to their defaults.
+ *
+ * As with `lzw_init_files`, the decompressor takes ownership of the files,
+ * and either may be NULL to just release the current ones.
+ * @param lzw The initialised LZW decompressor.
+ * @param src Source file, opened for binary reading.
+ * @param dst Destination file, opened for binary writing.
+ * @return LZW_OKAY if no error, otherwise LZW_WRITE_DST_ERROR if the output
+ * of the previous file could not be flushed.
+ */
+enum lzw_error lzw_reset(
+        struct lzw_decompressor *lzw,
+        FILE *src,
+        FILE *dst
+) {
+    assert(lzw);
+
+    enum lzw_error error = close_files(lzw);
+
+    lzw->src = src;
+    lzw->dst = dst;
+    lzw->dst_name = NULL;
+
+    dict_reset(&lzw->dict);
+    free(lzw->codes);
+    reset_state(lzw);
+
+    lzw->error = LZW_OKAY;
+    return error;
+}
+
 /**
  * Cleans up decompressor.
  */
@@ -147,12 +258,10 @@ void lzw_deinit(struct lzw_decompressor *lzw) {
     assert(lzw);
 
     /* Close files if opened. */
+    close_files(lzw);
 
-    assert(lzw->src);
-    fclose(lzw->src);
-
-    assert(lzw->dst);
-    fclose(lzw->dst);
+    /* Free the codes loaded in strict mode, if any. */
+    free(lzw->codes);
 
     /* De-initialise the dictionary. */
     dict_deinit(&lzw->dict);
@@ -169,14 +278,41 @@ enum lzw_error lzw_decompress(struct lzw_decompressor *lzw) {
     assert(lzw);
 
     GUARD_ANY(lzw);
+    GUARD(!lzw->src, LZW_OPEN_SRC_ERROR, lzw);
+    GUARD(!lzw->dst && !lzw->dst_name, LZW_OPEN_DST_ERROR, lzw);
+
+    // In strict mode, read and check every code before writing anything.
+    if (lzw->strict) {
+        lzw->error = load_codes(lzw);
+        GUARD_ANY(lzw);
+    }
+
+    // Only now open a destination given by path, so that it is not
+    // truncated if strict mode rejected the source.
+    if (!lzw->dst) {
+        lzw->dst = fopen(lzw->dst_name, "wb");
+        GUARD(!lzw->dst, LZW_OPEN_DST_ERROR, lzw);
+    }
+
+    // Holes can only be left in regular files, so write anything else (e.g.
+    // a pipe) plainly.
+    if (lzw->sparse && !is_regular_file(lzw->dst)) {
+        lzw->sparse = false;
+    }
 
     // Read the first code and look it up in the dictionary.
     int cur_code;
     struct dict_entry *cur_entry;
 
-    read_next_code(lzw, &cur_code);
+    bool has_code = read_next_code(lzw, &cur_code);
     GUARD_ANY(lzw);
 
+    // An empty source decompresses to nothing.
+    if (!has_code) {
+        lzw->error = finish_output(lzw);
+        return lzw->error;
+    }
+
     cur_entry = lookup_code(lzw, cur_code);
 
     // First code should be in the dictionary, otherwise invalid encoding.
@@ -189,8 +325,9 @@ enum lzw_error lzw_decompress(struct lzw_decompressor *lzw) {
     int last_code = cur_code;
     struct dict_entry *last_entry;
 
-    // Keep decompressing until all codes in the input file have been consumed.
-    while (read_next_code(lzw, &cur_code)) {
+    // Keep decompressing until all codes in the input file have been
+    // consumed, or enough output has been produced.
+    while (!lzw->stopped && read_next_code(lzw, &cur_code)) {
         // Update cur code, cur entry, and last entry. Last code updated at
         // end of loop.
         assert(!lzw_has_error(lzw->error));
@@ -215,6 +352,16 @@ enum lzw_error lzw_decompress(struct lzw_decompressor *lzw) {
 
             last_code = cur_code;
 
+        // If code is the next one to be added to the dictionary, it starts
+        // a chain of such codes (e.g. from a run of one byte). Decode the
+        // whole chain at once.
+        } else if (cur_code == lzw->dict.next_idx &&
+                   (size_t) cur_code < lzw->dict.capacity) {
+            unread_code(lzw, cur_code);
+
+            lzw->error = decode_chain(lzw, last_entry, &last_code);
+            GUARD_ANY(lzw);
+
         // If code is not in the dictionary, add <last entry><first byte of
         // last entry> to the dictionary, and write that to the output.
         } else {
@@ -228,6 +375,8 @@ enum lzw_error lzw_decompress(struct lzw_decompressor *lzw) {
 
             lzw->error = write_next(lzw, new_entry);
             GUARD_ANY(lzw);
+
+            last_code = (int) (new_entry - lzw->dict.entries);
         }
 
     }
@@ -235,6 +384,9 @@ enum lzw_error lzw_decompress(struct lzw_decompressor *lzw) {
     // Could have been a read error.
     GUARD_ANY(lzw);
 
+    // Write out anything still buffered and set the final size.
+    lzw->error = finish_output(lzw);
+
     return lzw->error;
 }
 
@@ -261,10 +413,83 @@ const char *lzw_error_msg(enum lzw_error error) {
     return lzw_error_msgs[error];
 }
 
+/**
+ * Checks if the given bytes are all zero, as when deciding whether a block of
+ * sparse output can be left as a hole.
+ *
+ * Rather than looping over each byte, checks the first byte is zero and then
+ * that the bytes equal themselves shifted along by one. `memcmp` is
+ * vectorised by the C library, so this runs at memory speed.
+ * @param bytes The bytes to check.
+ * @param size Number of bytes.
+ * @return true if all bytes are zero (or there are none), false otherwise.
+ */
+bool lzw_is_all_zero(const uint8_t *bytes, size_t size) {
+    if (size == 0) {
+        return true;
+    }
+
+    return bytes[0] == 0 && memcmp(bytes, bytes + 1, size - 1) == 0;
+}
+
 
 /*****************************   Helpers   ************************************/
 
 
+/**
+ * Sets the reading and writing state to that of a decompressor that has not
+ * yet read or written anything.
+ */
+static void reset_state(struct lzw_decompressor *lzw) {
+    assert(lzw);
+
+    /* Initialise odd to true, as next byte to be read is the first. */
+    lzw->odd = true;
+    lzw->has_peeked = false;
+
+    /* Strict mode is off by default. */
+    lzw->strict = false;
+    lzw->codes = NULL;
+    lzw->num_codes = 0;
+    lzw->next_code = 0;
+
+    /* Sparse output is off by default. */
+    lzw->sparse = false;
+    lzw->block_len = 0;
+
+    /* Run to the end of the source by default. */
+    lzw->max_output = SIZE_MAX;
+    lzw->on_output = NULL;
+    lzw->on_output_ctx = NULL;
+    lzw->out_size = 0;
+    lzw->stopped = false;
+}
+
+/**
+ * Closes the source and destination files, if open.
+ * @return LZW_WRITE_DST_ERROR if the destination could not be flushed,
+ * LZW_OKAY otherwise.
+ */
+static enum lzw_error close_files(struct lzw_decompressor *lzw) {
+    assert(lzw);
+
+    enum lzw_error error = LZW_OKAY;
+
+    if (lzw->src) {
+        fclose(lzw->src);
+        lzw->src = NULL;
+    }
+
+    if (lzw->dst) {
+        if (fclose(lzw->dst) != 0) {
+            error = LZW_WRITE_DST_ERROR;
+        }
+        lzw->dst = NULL;
+    }
+
+    return error;
+}
+
 /**
  * In newly allocated memory, copies over the given entry plus the given byte
  * appended at the end, then inserts this into the dictionary. Places the
@@ -304,22 +529,237 @@ static enum lzw_error append_byte_and_add_to_dict(
     return LZW_OKAY;
 }
 
+/**
+ * Decodes a chain of codes that are each the next code to be added to the
+ * dictionary (the KwKwK case). Such chains come from repetitive input, most
+ * commonly runs of a single byte.
+ *
+ * If the last entry is w, with first byte c, the chain's codes decode to
+ * w c, w c c, w c c c, and so on, each being added to the dictionary. Every
+ * one of these is a prefix of the longest, so rather than copying each into
+ * its own allocation, the whole chain is read ahead, the longest is built
+ * once, and the rest are added as shared prefixes of it. Each entry is then
+ * written straight from the shared bytes.
+ *
+ * The chain is cut short before the dictionary would reset, as all its
+ * entries have to be freed together. The code that ends the chain is left
+ * to be read next.
+ * @param lzw The decompressor, whose next code starts the chain.
+ * @param last_entry The entry of the code before the chain.
+ * @param last_code Set to the code of the last entry of the chain.
+ * @return `enum lzw_error` error code.
+ */
+static enum lzw_error decode_chain(
+        struct lzw_decompressor *lzw,
+        struct dict_entry *last_entry,
+        int *last_code
+) {
+    assert(lzw);
+    assert(last_entry);
+    assert(last_code);
+
+    int first_code = lzw->dict.next_idx;
+    int max_len = (int) lzw->dict.capacity - first_code;
+    assert(max_len > 0);
+
+    /* Read ahead to find the length of the chain. */
+
+    // Don't read further ahead than the output that is still wanted.
+    size_t wanted = lzw->max_output - lzw->out_size;
+    size_t chain_size = 0;
+
+    int len = 0;
+    int code;
+    while (len < max_len && chain_size < wanted &&
+           read_next_code(lzw, &code)) {
+        if (code != first_code + len) {
+            unread_code(lzw, code);
+            break;
+        }
+        len++;
+        chain_size += last_entry->size + len;
+    }
+    GUARD_ANY(lzw);
+    assert(len > 0);
+
+    /* Build the longest entry, w followed by `len` copies of c. */
+
+    size_t w_size = last_entry->size;
+    uint8_t *bytes = malloc(sizeof(uint8_t) * (w_size + len));
+    if (!bytes) {
+        return LZW_HEAP_ERROR;
+    }
+
+    memcpy(bytes, last_entry->bytes, w_size);
+    memset(&bytes[w_size], last_entry->bytes[0], (size_t) len);
+
+    /* Add the entries, the last one owning the bytes. */
+
+    // All are added before any is written, so the dictionary owns the bytes
+    // even if a write fails, and is left consistent with the codes read even
+    // if the output stops.
+    for (int i = 1; i < len; i++) {
+        dict_add_shared(&lzw->dict, bytes, w_size + i);
+    }
+    dict_add(&lzw->dict, bytes, w_size + len);
+
+    /* Write the entries. */
+
+    for (int i = 1; i <= len && !lzw->stopped; i++) {
+        enum lzw_error error = write_bytes(lzw, bytes, w_size + i);
+        if (lzw_has_error(error)) {
+            return error;
+        }
+    }
+
+    *last_code = first_code + len - 1;
+    return LZW_OKAY;
+}
+
+/**
+ * Writes the given entry to the destination file. See `write_bytes`.
+ * @return `enum lzw_error` error code.
+ */
 static enum lzw_error write_next(
         struct lzw_decompressor *lzw,
         struct dict_entry *entry
+) {
+    assert(entry);
+
+    return write_bytes(lzw, entry->bytes, entry->size);
+}
+
+/**
+ * Writes the given bytes to the destination file.
+ *
+ * If `lzw->sparse` is set, the output is instead gathered into aligned blocks
+ * of `LZW_SPARSE_BLOCK_SIZE` bytes, and each full block is handed to
+ * `flush_block`, which seeks over it rather than writing it if it is all
+ * zero. `finish_output` must be called once decompression is over to write
+ * the last partial block and set the final file size.
+ *
+ * Once `lzw->max_output` bytes have been produced, or `lzw->on_output` asks
+ * to stop, sets `lzw->stopped` and drops any further output.
+ * @return `enum lzw_error` error code.
+ */
+static enum lzw_error write_bytes(
+        struct lzw_decompressor *lzw,
+        const uint8_t *bytes,
+        size_t size
 ) {
     assert(lzw);
     assert(!lzw_has_error(lzw->error));
     assert(lzw->dst);
 
-    size_t written = fwrite(
-            entry->bytes,
-            sizeof(uint8_t),
-            entry->size,
-            lzw->dst
-    );
+    if (lzw->stopped) {
+        return LZW_OKAY;
+    }
+
+    // Cut the output short at the limit.
+    size_t wanted = lzw->max_output - lzw->out_size;
+    if (size >= wanted) {
+        size = wanted;
+        lzw->stopped = true;
+    }
+
+    lzw->out_size += size;
+
+    if (lzw->on_output && size > 0 &&
+        !lzw->on_output(lzw->on_output_ctx, bytes, size)) {
+        lzw->stopped = true;
+    }
+
+    if (!lzw->sparse) {
+        size_t written = fwrite(bytes, sizeof(uint8_t), size, lzw->dst);
+
+        return size == written ? LZW_OKAY : LZW_WRITE_DST_ERROR;
+    }
+
+    // Copy the bytes into the block buffer, flushing each time it fills up.
+    // The bytes can be more than what is left of the block, so may span
+    // several blocks.
+    size_t remaining = size;
+
+    while (remaining > 0) {
+        size_t space = LZW_SPARSE_BLOCK_SIZE - lzw->block_len;
+        size_t n = remaining < space ? remaining : space;
+
+        memcpy(&lzw->block[lzw->block_len], bytes, n);
+        lzw->block_len += n;
+        bytes += n;
+        remaining -= n;
+
+        if (lzw->block_len == LZW_SPARSE_BLOCK_SIZE) {
+            enum lzw_error error = flush_block(lzw);
+            if (lzw_has_error(error)) {
+                return error;
+            }
+        }
+    }
+
+    return LZW_OKAY;
+}
+
+/**
+ * Empties the sparse output block buffer into the destination file. If the
+ * buffered bytes are all zero, seeks past them instead of writing them,
+ * leaving a hole.
+ * @return `enum lzw_error` error code.
+ */
+static enum lzw_error flush_block(struct lzw_decompressor *lzw) {
+    assert(lzw);
+    assert(lzw->sparse);
+
+    size_t len = lzw->block_len;
+    lzw->block_len = 0;
+
+    if (lzw_is_all_zero(lzw->block, len)) {
+        return fseek(lzw->dst, (long) len, SEEK_CUR) == 0 ?
+               LZW_OKAY : LZW_WRITE_DST_ERROR;
+    }
+
+    size_t written = fwrite(lzw->block, sizeof(uint8_t), len, lzw->dst);
+
+    return len == written ? LZW_OKAY : LZW_WRITE_DST_ERROR;
+}
+
+/**
+ * Completes the output once all codes have been decompressed. In sparse mode,
+ * flushes the last partial block and truncates the destination file to the
+ * total output size, as seeking past trailing zero blocks does not extend the
+ * file by itself.
+ * @return `enum lzw_error` error code.
+ */
+static enum lzw_error finish_output(struct lzw_decompressor *lzw) {
+    assert(lzw);
+    assert(!lzw_has_error(lzw->error));
+
+    if (!lzw->sparse) {
+        return LZW_OKAY;
+    }
+
+    enum lzw_error error = flush_block(lzw);
+    if (lzw_has_error(error)) {
+        return error;
+    }
+
+    if (fflush(lzw->dst) != 0 ||
+        ftruncate(fileno(lzw->dst), (off_t) lzw->out_size) != 0) {
+        return LZW_WRITE_DST_ERROR;
+    }
+
+    return LZW_OKAY;
+}
+
+/**
+ * Checks if the given file is a regular file, and so can be seeked past the
+ * end of and truncated.
+ */
+static bool is_regular_file(FILE *f) {
+    assert(f);
 
-    return entry->size == written ? LZW_OKAY : LZW_WRITE_DST_ERROR;
+    struct stat st;
+    return fstat(fileno(f), &st) == 0 && S_ISREG(st.st_mode);
 }
 
 /**
@@ -373,6 +813,22 @@ bool read_next_code(struct lzw_decompressor *lzw, int *code) {
     assert(lzw);
     assert(!lzw_has_error(lzw->error));
 
+    // Return a code that was read ahead and put back, if any.
+    if (lzw->has_peeked) {
+        *code = lzw->peeked_code;
+        lzw->has_peeked = false;
+        return true;
+    }
+
+    // In strict mode, all the codes have already been read.
+    if (lzw->codes) {
+        if (lzw->next_code == lzw->num_codes) {
+            return false;
+        }
+        *code = lzw->codes[lzw->next_code++];
+        return true;
+    }
+
     // Will read data into here.
     uint8_t data[3];
 
@@ -402,9 +858,13 @@ bool read_next_code(struct lzw_decompressor *lzw, int *code) {
          *
          * Left shift the first byte by 8 to make room for the entire second
          * byte as the second half of the 16-bit code.
+         *
+         * Leave `odd` as is, so the next call tries to read more bytes and
+         * finds the EOF, rather than using stale cached bytes.
          */
         if (n == 2) {
             *code = (((int) data[0]) << BYTE_IN_BITS) | (int) data[1];
+            return true;
 
         /*
          * If successfully read all three bytes: not EOF and odd number of
@@ -441,3 +901,193 @@ bool read_next_code(struct lzw_decompressor *lzw, int *code) {
     lzw->odd = !lzw->odd;
     return true;
 }
+
+/**
+ * Puts back a code that was read ahead, so it is returned by the next call
+ * to `read_next_code`. Only one code can be put back at a time.
+ */
+static void unread_code(struct lzw_decompressor *lzw, int code) {
+    assert(lzw);
+    assert(!lzw->has_peeked);
+
+    lzw->peeked_code = code;
+    lzw->has_peeked = true;
+}
+
+/**
+ * Reads the rest of the source file and unpacks all of its codes into
+ * `lzw->codes`, then checks every code is valid for its position in the
+ * stream. Codes are then read from `lzw->codes` by `read_next_code`.
+ *
+ * This rejects invalid files before any output is written, unlike
+ * `lzw_decompress`, which otherwise only finds out about invalid codes (if
+ * at all) once it reaches them.
+ *
+ * Uses the same layout as `read_next_code`: two codes per three bytes, with
+ * a trailing two bytes forming a padded 16-bit code.
+ * @return LZW_OKAY if all codes are valid, LZW_INVALID_FORMAT_ERROR if not,
+ * otherwise the error encountered.
+ */
+static enum lzw_error load_codes(struct lzw_decompressor *lzw) {
+    assert(lzw);
+    assert(!lzw_has_error(lzw->error));
+    assert(!lzw->codes);
+
+    uint8_t *bytes;
+    size_t size;
+    enum lzw_error error = read_all(lzw->src, &bytes, &size);
+    if (lzw_has_error(error)) {
+        return error;
+    }
+
+    // A single trailing byte cannot form a code, see `read_next_code`.
+    if (size % 3 == 1) {
+        free(bytes);
+        return LZW_READ_ERROR;
+    }
+
+    /* Unpack the codes. */
+
+    size_t num_triples = size / 3;
+    size_t num_codes = num_triples * 2 + (size % 3 == 2 ? 1 : 0);
+
+    // Allocate at least one code so an empty source still gets an array.
+    uint16_t *codes = malloc(sizeof(uint16_t) * (num_codes ? num_codes : 1));
+    if (!codes) {
+        free(bytes);
+        return LZW_HEAP_ERROR;
+    }
+
+    for (size_t i = 0; i < num_triples; i++) {
+        const uint8_t *b = &bytes[i * 3];
+        codes[i * 2] = (uint16_t) ((b[0] << HALF_BYTE_IN_BITS) |
+                                   (b[1] >> HALF_BYTE_IN_BITS));
+        codes[i * 2 + 1] = (uint16_t) (((b[1] & CLEAR_FIRST_HALF)
+                                        << BYTE_IN_BITS) | b[2]);
+    }
+
+    if (size % 3 == 2) {
+        const uint8_t *b = &bytes[num_triples * 3];
+        codes[num_codes - 1] = (uint16_t) ((b[0] << BYTE_IN_BITS) | b[1]);
+    }
+
+    free(bytes);
+
+    /* Check them. */
+
+    if (!codes_in_bounds(codes, num_codes, lzw->dict.capacity)) {
+        free(codes);
+        return LZW_INVALID_FORMAT_ERROR;
+    }
+
+    lzw->codes = codes;
+    lzw->num_codes = num_codes;
+    lzw->next_code = 0;
+
+    return LZW_OKAY;
+}
+
+/**
+ * Reads the rest of a file into newly allocated memory, placed in `bytes`,
+ * with its size placed in `size`.
+ * @return `enum lzw_error` error code.
+ */
+static enum lzw_error read_all(FILE *f, uint8_t **bytes, size_t *size) {
+    assert(f);
+    assert(bytes);
+    assert(size);
+
+    size_t capacity = 64 * 1024;
+    size_t len = 0;
+    uint8_t *buf = malloc(capacity);
+    if (!buf) {
+        return LZW_HEAP_ERROR;
+    }
+
+    for (;;) {
+        len += fread(&buf[len], sizeof(uint8_t), capacity - len, f);
+
+        if (len < capacity) {
+            break;
+        }
+
+        // Filled the buffer, so there may be more to read.
+        capacity *= 2;
+        uint8_t *grown = realloc(buf, capacity);
+        if (!grown) {
+            free(buf);
+            return LZW_HEAP_ERROR;
+        }
+        buf = grown;
+    }
+
+    if (ferror(f)) {
+        free(buf);
+        return LZW_READ_ERROR;
+    }
+
+    *bytes = buf;
+    *size = len;
+    return LZW_OKAY;
+}
+
+/**
+ * Checks every code is one that `lzw_decompress` can decode without
+ * guessing.
+ *
+ * The first code must be a single byte. After that, each code adds one entry
+ * to the dictionary, so the dictionary's size before each code is known
+ * without decoding anything: it starts at 256 and goes up by one per code
+ * until it reaches the capacity, after which it resets and the next code
+ * finds it at 257. Each code must be at most the dictionary's current size
+ * (equal to it being the KwKwK case), and below the capacity.
+ *
+ * Between resets, the bound goes up by exactly one per code, so each segment
+ * is checked with a branch-free loop, which GCC vectorises at -O3 (as in the
+ * default Release build). Unpacking the codes in `load_codes` is not
+ * vectorised, as its 3-byte stride does not map onto vector lanes.
+ * @return true if all codes are valid, false otherwise.
+ */
+static bool codes_in_bounds(
+        const uint16_t *codes,
+        size_t num_codes,
+        size_t capacity
+) {
+    if (num_codes == 0) {
+        return true;
+    }
+
+    if (codes[0] >= NUM_BYTE_CODES) {
+        return false;
+    }
+
+    // Only the padded last code can reach the capacity, other codes are too
+    // narrow to.
+    if (codes[num_codes - 1] >= capacity) {
+        return false;
+    }
+
+    size_t i = 1;
+    uint32_t bound = NUM_BYTE_CODES;
+    uint16_t out_of_bounds = 0;
+
+    while (i < num_codes) {
+        // Codes until and including the one that finds the dictionary full.
+        size_t segment = capacity - bound + 1;
+        if (segment > num_codes - i) {
+            segment = num_codes - i;
+        }
+
+        // Kept to 16-bit lanes, as codes and bounds both fit in 16 bits.
+        const uint16_t *seg_codes = &codes[i];
+        uint16_t seg_bound = (uint16_t) bound;
+        for (size_t j = 0; j < segment; j++) {
+            out_of_bounds |= seg_codes[j] > (uint16_t) (seg_bound + j);
+        }
+
+        i += segment;
+        bound = NUM_BYTE_CODES + 1;
+    }
+
+    return out_of_bounds == 0;
+}
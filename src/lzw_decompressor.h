@@ -5,8 +5,23 @@
 #include <stddef.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdint.h>
 #include "lzw_dict.h"
 
+/*
+ * Size of the blocks the output is split into when writing sparsely. Blocks
+ * of this size that are entirely zero are skipped over instead of written,
+ * leaving a hole in the destination file. Should be a multiple of the
+ * filesystem block size for the holes to actually save disk space.
+ */
+#define LZW_SPARSE_BLOCK_SIZE 4096
+
+/*
+ * Called with each piece of output as it is produced, along with the `ctx`
+ * given to the decompressor. Returns false to stop decompressing early.
+ */
+typedef bool (*lzw_output_fn)(void *ctx, const uint8_t *bytes, size_t size);
+
 enum lzw_error {
     LZW_OKAY,
     LZW_UNKNOWN_ERROR,
@@ -16,12 +31,16 @@ enum lzw_error {
     LZW_WRITE_DST_ERROR,
     LZW_READ_ERROR,
     LZW_INVALID_FORMAT_ERROR,
+    LZW_CACHE_ERROR,
+    LZW_SOCKET_ERROR,
 };
 
 struct lzw_decompressor {
     enum lzw_error error;      // Error code.
     FILE *src;                 // Source file.
     FILE *dst;                 // Destination file.
+    char *dst_name;            // If set, path `dst` is opened from once the
+                               // source has been validated.
     struct lzw_dict dict;      // LZW dictionary used in decompression.
 
     /*
@@ -31,6 +50,38 @@ struct lzw_decompressor {
     uint8_t prev_bytes[2];     // Last two read bytes.
     bool odd;                  // If next code to be read is k^th code, true if
                                // k is odd, else false.
+    bool has_peeked;           // If true, `peeked_code` was read ahead and
+    int peeked_code;           // will be returned by the next read.
+
+    /*
+     * Strict mode. Set `strict` to true after `lzw_init` to read and
+     * validate every code before producing any output. See `load_codes` in
+     * .c for more info.
+     */
+    bool strict;               // If true, reject invalid codes up front.
+    uint16_t *codes;           // All codes of the source, once validated.
+    size_t num_codes;          // Number of codes in `codes`.
+    size_t next_code;          // Index in `codes` of the next code to read.
+
+    /*
+     * Sparse output. Set `sparse` to true after `lzw_init` to enable. See
+     * `write_bytes` in .c for more info.
+     */
+    bool sparse;               // If true, skip all-zero blocks in output.
+    size_t block_len;          // Number of bytes buffered in `block`.
+    uint8_t block[LZW_SPARSE_BLOCK_SIZE]; // Block of output being buffered.
+
+    /*
+     * Early termination. Set these after `lzw_init` to stop decompressing
+     * once enough output has been produced, without reading the rest of the
+     * source file.
+     */
+    size_t max_output;         // Stop after this many bytes of output.
+                               // SIZE_MAX (the default) for no limit.
+    lzw_output_fn on_output;   // If not NULL, called with all output.
+    void *on_output_ctx;       // Passed to `on_output`.
+    size_t out_size;           // Total bytes of output produced so far.
+    bool stopped;              // True once decompression stopped early.
 };
 
 enum lzw_error lzw_init(
@@ -39,6 +90,18 @@ enum lzw_error lzw_init(
         char *dst_name
 );
 
+enum lzw_error lzw_init_files(
+        struct lzw_decompressor *lzw,
+        FILE *src,
+        FILE *dst
+);
+
+enum lzw_error lzw_reset(
+        struct lzw_decompressor *lzw,
+        FILE *src,
+        FILE *dst
+);
+
 void lzw_deinit(
         struct lzw_decompressor *lzw
 );
@@ -55,4 +118,9 @@ const char *lzw_error_msg(
         enum lzw_error
 );
 
+bool lzw_is_all_zero(
+        const uint8_t *bytes,
+        size_t size
+);
+
 #endif //LZW_COMPRESSION_LZW_H
@@ -9,16 +9,27 @@
 #define NUM_ASCII_VALUES 256
 #define CODE_WIDTH_BITS 12
 
+/* Used to generate the ASCII table at its declaration, 16 values at a time. */
+#define ASCII_ROW(n) \
+    (n) + 0, (n) + 1, (n) + 2, (n) + 3, (n) + 4, (n) + 5, (n) + 6, (n) + 7, \
+    (n) + 8, (n) + 9, (n) + 10, (n) + 11, (n) + 12, (n) + 13, (n) + 14, (n) + 15
+
 /* Mallocing each byte of the initial entries individually is inefficient.
  * Also, it is wasteful as these entries are always the same thing for
  * every dictionary, so they can be shared. Thus, keep one global ASCII
  * table and initialise each dictionary's entries to point to it.
+ *
+ * The table is filled in at compile time and never written to, so
+ * dictionaries can be initialised from several threads at once (e.g. by the
+ * daemon's workers).
  */
-static bool ascii_table_initialised = false;
-static uint8_t ascii_table[NUM_ASCII_VALUES];
-static void initialise_ascii_table(void);
+static uint8_t ascii_table[NUM_ASCII_VALUES] = {
+        ASCII_ROW(0x00), ASCII_ROW(0x10), ASCII_ROW(0x20), ASCII_ROW(0x30),
+        ASCII_ROW(0x40), ASCII_ROW(0x50), ASCII_ROW(0x60), ASCII_ROW(0x70),
+        ASCII_ROW(0x80), ASCII_ROW(0x90), ASCII_ROW(0xA0), ASCII_ROW(0xB0),
+        ASCII_ROW(0xC0), ASCII_ROW(0xD0), ASCII_ROW(0xE0), ASCII_ROW(0xF0)
+};
 
-static void reset_dict(struct lzw_dict *dict);
 static void deinit_dict_entries(struct lzw_dict *dict);
 
 /**
@@ -27,13 +38,6 @@ static void deinit_dict_entries(struct lzw_dict *dict);
  * @return true if initialisation successful, false otherwise.
  */
 bool dict_init(struct lzw_dict *dict) {
-    // FIXME: This is terrible. Ideally would use some kind of CPP for-loop to
-    // generate in-line the ASCII entries at the declaration.
-    if (!ascii_table_initialised) {
-        initialise_ascii_table();
-        ascii_table_initialised = true;
-    }
-
     assert(dict);
 
     // TODO: Protect against ridiculously large array.
@@ -96,18 +100,36 @@ struct dict_entry *dict_add(
 
     // If too big, reset dictionary.
     if ((size_t) dict->next_idx >= dict->capacity) {
-        reset_dict(dict);
+        dict_reset(dict);
     }
 
     // Set size and bytes and increment dictionary next index.
     struct dict_entry *new_entry = &dict->entries[dict->next_idx];
     new_entry->size = size;
     new_entry->bytes = bytes;
+    new_entry->shared = false;
 
     dict->next_idx += 1;
     return new_entry;
 }
 
+/**
+ * Adds to the dictionary an entry of the given size whose bytes are borrowed
+ * from another entry, e.g. because it is a prefix of that entry. The bytes
+ * are not freed with this entry, so the entry owning them must be added
+ * after this one and before the dictionary next resets.
+ */
+struct dict_entry *dict_add_shared(
+        struct lzw_dict *dict,
+        uint8_t *bytes,
+        size_t size
+) {
+    struct dict_entry *new_entry = dict_add(dict, bytes, size);
+    new_entry->shared = true;
+
+    return new_entry;
+}
+
 /**
  * Gets the `struct dict_entry` at `code` in the dictionary `dict`. Returns
  * null if not present.
@@ -121,17 +143,11 @@ struct dict_entry *dict_get(
     return dict_contains(dict, code) ? &dict->entries[code] : NULL;
 }
 
-static void initialise_ascii_table(void) {
-    for (int i = 0; i < NUM_ASCII_VALUES; i++) {
-        ascii_table[i] = (uint8_t) i;
-    }
-}
-
 /**
  * Resets the dictionary so that it only contains the ASCII values as the
  * first 256 entries.
  */
-static void reset_dict(struct lzw_dict *dict) {
+void dict_reset(struct lzw_dict *dict) {
     assert(dict);
 
     deinit_dict_entries(dict);
@@ -150,7 +166,10 @@ static void deinit_dict_entries(struct lzw_dict *dict) {
     // Start at NUM_ASCII_VALUES as those before point to the statically
     // allocated ASCII table array.
     // Stop at `dict->next_idx` as the rest should be unused; not allocated.
+    // Skip shared entries, as their bytes are freed with their owner.
     for (int i = NUM_ASCII_VALUES; i < dict->next_idx; i++) {
-        free(dict->entries[i].bytes);
+        if (!dict->entries[i].shared) {
+            free(dict->entries[i].bytes);
+        }
     }
 }
@@ -3,10 +3,15 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include <stdbool.h>
 
 struct dict_entry {
     size_t size;
     uint8_t *bytes;
+
+    /* If true, `bytes` points into the bytes of a later entry, so is not
+     * freed with this entry. See `dict_add_shared`. */
+    bool shared;
 };
 
 struct lzw_dict {
@@ -44,11 +49,21 @@ struct dict_entry *dict_add(
         size_t size
 );
 
+struct dict_entry *dict_add_shared(
+        struct lzw_dict *dict,
+        uint8_t *bytes,
+        size_t size
+);
+
 struct dict_entry *dict_get(
         struct lzw_dict *dict,
         int code
 );
 
+void dict_reset(
+        struct lzw_dict *dict
+);
+
 void dict_deinit(
         struct lzw_dict *dict
 );
@@ -1,19 +1,49 @@
 #include <stdio.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include "lzw_decompressor.h"
+#include "lzw_cache.h"
+#include "lzw_daemon.h"
 
-#define REQUIRED_ARGC 3
+#define REQUIRED_POSITIONAL_ARGS 2
+
+/* Default bound on the size of the cache, 256 MiB. */
+#define DEFAULT_CACHE_SIZE ((size_t) 256 * 1024 * 1024)
 
 static struct args {
     bool error;
     char *src_file;
     char *dst_file;
+    bool sparse;
+    bool strict;               // Validate all codes before any output.
+    size_t max_bytes;          // Stop after this many bytes of output.
+    char *cache_dir;
+    size_t cache_size;
+    char *daemon_socket;       // Run as a daemon listening on this socket.
+    int num_workers;
+    char *connect_socket;      // Send the job to the daemon on this socket.
 };
 
 static void parse_args(struct args *args, int argc, char *argv[]);
 
+static bool parse_number(
+        const char *str,
+        unsigned long long max,
+        unsigned long long *value
+);
+
+static enum lzw_error decompress(struct args *args);
+
+static enum lzw_error decompress_via_daemon(struct args *args);
+
 int main(int argc, char *argv[]) {
     // Parse arguments.
     struct args args;
@@ -21,54 +51,213 @@ int main(int argc, char *argv[]) {
 
     // If invalid args, print usage msg and fail with error.
     if (args.error) {
-        fprintf(stderr, "Usage: ./lzw_decompressor <src_file> <dst_file>");
+        fprintf(stderr, "Usage: ./lzw_decompressor [--sparse] [--strict] "
+                        "[--max-bytes <n>]\n"
+                        "                          [--cache-dir <dir>] "
+                        "[--cache-size <bytes>]\n"
+                        "                          [--connect <socket>] "
+                        "<src_file> <dst_file>\n"
+                        "       ./lzw_decompressor --daemon <socket> "
+                        "[--workers <n>]\n");
+        return EXIT_FAILURE;
+    }
+
+    /* Perform decompression, through the daemon or cache if one was given. */
+
+    enum lzw_error error;
+    if (args.daemon_socket) {
+        struct lzw_daemon daemon = {
+                .socket_path = args.daemon_socket,
+                .num_workers = args.num_workers
+        };
+        error = lzw_daemon_run(&daemon);
+    } else if (args.connect_socket) {
+        error = decompress_via_daemon(&args);
+    } else if (args.cache_dir) {
+        struct lzw_cache cache = {
+                .dir = args.cache_dir,
+                .max_size = args.cache_size
+        };
+        error = lzw_cache_decompress(
+                &cache,
+                args.src_file,
+                args.dst_file,
+                args.sparse
+        );
+    } else {
+        error = decompress(&args);
+    }
+
+    if (lzw_has_error(error)) {
+        fprintf(stderr, "ERROR: %s.\n", lzw_error_msg(error));
         return EXIT_FAILURE;
     }
 
-    /* Perform decompression. */
+    return EXIT_SUCCESS;
+}
+
+/*
+ * Decompresses the source file into the destination file.
+ */
+static enum lzw_error decompress(struct args *args) {
+    assert(args);
 
     struct lzw_decompressor lzw;
     enum lzw_error error = lzw_init(
             &lzw,
-            args.src_file,
-            args.dst_file
+            args->src_file,
+            args->dst_file
     );
 
     if (lzw_has_error(error)) {
-        fprintf(stderr, "ERROR: %s.\n", lzw_error_msg(error));
-        return EXIT_FAILURE;
+        return error;
     }
 
+    lzw.sparse = args->sparse;
+    lzw.strict = args->strict;
+    lzw.max_output = args->max_bytes;
+
     error = lzw_decompress(&lzw);
 
-    int exit_code;
-    if (lzw_has_error(error)) {
-        fprintf(stderr, "ERROR: %s.\n", lzw_error_msg(error));
-        exit_code = EXIT_FAILURE;
-    } else {
-        exit_code = EXIT_SUCCESS;
+    lzw_deinit(&lzw);
+
+    return error;
+}
+
+/*
+ * Has the daemon decompress the source file into the destination file,
+ * passing it the opened files.
+ */
+static enum lzw_error decompress_via_daemon(struct args *args) {
+    assert(args);
+
+    int src_fd = open(args->src_file, O_RDONLY);
+    if (src_fd < 0) {
+        return LZW_OPEN_SRC_ERROR;
     }
 
-    lzw_deinit(&lzw);
+    int dst_fd = open(args->dst_file, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (dst_fd < 0) {
+        close(src_fd);
+        return LZW_OPEN_DST_ERROR;
+    }
 
-    return exit_code;
+    enum lzw_error error = LZW_SOCKET_ERROR;
+
+    int conn = lzw_daemon_connect(args->connect_socket);
+    if (conn >= 0) {
+        error = lzw_daemon_decompress_fds(conn, src_fd, dst_fd, args->sparse);
+        close(conn);
+    }
+
+    close(src_fd);
+    close(dst_fd);
+
+    return error;
 }
 
 /*
  * Parses the arguments of the program.
+ * Options come first, followed by the source and destination files.
  * Checks correct number of args and args themselves are valid.
  * If ok, args->error is false, true otherwise.
  */
 static void parse_args(struct args *args, int argc, char *argv[]) {
     assert(args);
 
-    if (argc != REQUIRED_ARGC) {
+    args->sparse = false;
+    args->strict = false;
+    args->max_bytes = SIZE_MAX;
+    args->cache_dir = NULL;
+    args->cache_size = DEFAULT_CACHE_SIZE;
+    args->daemon_socket = NULL;
+    args->num_workers = 0;
+    args->connect_socket = NULL;
+
+    int i = 1;
+    for (; i < argc && strncmp(argv[i], "--", 2) == 0; i++) {
+        // Options that take a value need one more argument.
+        bool has_value = i + 1 < argc;
+        unsigned long long value;
+
+        if (strcmp(argv[i], "--sparse") == 0) {
+            args->sparse = true;
+        } else if (strcmp(argv[i], "--strict") == 0) {
+            args->strict = true;
+        } else if (strcmp(argv[i], "--max-bytes") == 0 && has_value) {
+            if (!parse_number(argv[++i], SIZE_MAX, &value)) {
+                args->error = true;
+                return;
+            }
+            args->max_bytes = (size_t) value;
+        } else if (strcmp(argv[i], "--cache-dir") == 0 && has_value) {
+            args->cache_dir = argv[++i];
+        } else if (strcmp(argv[i], "--cache-size") == 0 && has_value) {
+            if (!parse_number(argv[++i], SIZE_MAX, &value)) {
+                args->error = true;
+                return;
+            }
+            args->cache_size = (size_t) value;
+        } else if (strcmp(argv[i], "--daemon") == 0 && has_value) {
+            args->daemon_socket = argv[++i];
+        } else if (strcmp(argv[i], "--workers") == 0 && has_value) {
+            if (!parse_number(argv[++i], INT_MAX, &value)) {
+                args->error = true;
+                return;
+            }
+            args->num_workers = (int) value;
+        } else if (strcmp(argv[i], "--connect") == 0 && has_value) {
+            args->connect_socket = argv[++i];
+        } else {
+            args->error = true;
+            return;
+        }
+    }
+
+    // The daemon takes its files and their options from its clients.
+    bool limited = args->max_bytes != SIZE_MAX;
+    if (args->daemon_socket) {
+        args->error = i != argc || args->sparse || args->strict || limited ||
+                      args->cache_dir || args->connect_socket;
+        return;
+    }
+
+    // Partial output is not cached, and neither option is supported by the
+    // daemon.
+    if (argc - i != REQUIRED_POSITIONAL_ARGS ||
+        (limited && (args->cache_dir || args->connect_socket)) ||
+        (args->strict && (args->cache_dir || args->connect_socket))) {
         args->error = true;
         return;
     }
 
     // TODO: Check valid
-    args->src_file = argv[1];
-    args->dst_file = argv[2];
+    args->src_file = argv[i];
+    args->dst_file = argv[i + 1];
     args->error = false;
 }
+
+/*
+ * Parses the value of a numeric option, a non-negative decimal number no
+ * greater than max. Unlike `strtoull` alone, rejects empty values, signs
+ * (so "-1" does not wrap around) and values out of range.
+ * Returns true if ok, false otherwise.
+ */
+static bool parse_number(
+        const char *str,
+        unsigned long long max,
+        unsigned long long *value
+) {
+    assert(str);
+    assert(value);
+
+    if (!isdigit((unsigned char) str[0])) {
+        return false;
+    }
+
+    char *end;
+    errno = 0;
+    *value = strtoull(str, &end, 10);
+
+    return *end == '\0' && errno != ERANGE && *value <= max;
+}
@@ -0,0 +1,183 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <assert.h>
+#include <string.h>
+#include "sha256.h"
+
+static void compress_block(struct sha256 *sha, const uint8_t *block);
+
+/* Rotates a 32-bit word right by `n` bits. */
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+/* Round constants: first 32 bits of the fractional parts of the cube roots
+ * of the first 64 primes. */
+static const uint32_t k[64] = {
+        0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+        0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+        0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+        0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+        0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+        0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+        0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+        0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+        0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+        0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+        0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+        0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+        0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+        0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+        0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+        0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+/**
+ * Initialises a SHA-256 computation.
+ */
+void sha256_init(struct sha256 *sha) {
+    assert(sha);
+
+    // First 32 bits of the fractional parts of the square roots of the
+    // first 8 primes.
+    static const uint32_t initial_state[8] = {
+            0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+            0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+
+    memcpy(sha->state, initial_state, sizeof(initial_state));
+    sha->len = 0;
+    sha->block_len = 0;
+}
+
+/**
+ * Feeds the given bytes into the computation.
+ */
+void sha256_update(struct sha256 *sha, const uint8_t *bytes, size_t size) {
+    assert(sha);
+    assert(bytes || size == 0);
+
+    sha->len += size;
+
+    // Top up a partial block first.
+    if (sha->block_len > 0) {
+        size_t n = SHA256_BLOCK_SIZE - sha->block_len;
+        if (n > size) {
+            n = size;
+        }
+
+        memcpy(&sha->block[sha->block_len], bytes, n);
+        sha->block_len += n;
+        bytes += n;
+        size -= n;
+
+        if (sha->block_len < SHA256_BLOCK_SIZE) {
+            return;
+        }
+
+        compress_block(sha, sha->block);
+        sha->block_len = 0;
+    }
+
+    // Compress whole blocks straight from the input.
+    while (size >= SHA256_BLOCK_SIZE) {
+        compress_block(sha, bytes);
+        bytes += SHA256_BLOCK_SIZE;
+        size -= SHA256_BLOCK_SIZE;
+    }
+
+    memcpy(sha->block, bytes, size);
+    sha->block_len = size;
+}
+
+/**
+ * Pads the input and places the final digest into `digest`.
+ */
+void sha256_final(struct sha256 *sha, uint8_t digest[SHA256_DIGEST_SIZE]) {
+    assert(sha);
+    assert(digest);
+
+    uint64_t len_bits = sha->len * 8;
+
+    // Append a 1 bit, then zeros until 8 bytes short of a block boundary.
+    sha->block[sha->block_len++] = 0x80;
+
+    if (sha->block_len > SHA256_BLOCK_SIZE - 8) {
+        memset(&sha->block[sha->block_len], 0,
+               SHA256_BLOCK_SIZE - sha->block_len);
+        compress_block(sha, sha->block);
+        sha->block_len = 0;
+    }
+
+    memset(&sha->block[sha->block_len], 0,
+           SHA256_BLOCK_SIZE - 8 - sha->block_len);
+
+    // Finish with the length of the input in bits, big-endian.
+    for (int i = 0; i < 8; i++) {
+        sha->block[SHA256_BLOCK_SIZE - 1 - i] = (uint8_t) (len_bits >> (8 * i));
+    }
+    compress_block(sha, sha->block);
+
+    for (int i = 0; i < 8; i++) {
+        digest[i * 4] = (uint8_t) (sha->state[i] >> 24);
+        digest[i * 4 + 1] = (uint8_t) (sha->state[i] >> 16);
+        digest[i * 4 + 2] = (uint8_t) (sha->state[i] >> 8);
+        digest[i * 4 + 3] = (uint8_t) sha->state[i];
+    }
+}
+
+/**
+ * Runs the compression function over one 64-byte block.
+ */
+static void compress_block(struct sha256 *sha, const uint8_t *block) {
+    uint32_t w[64];
+
+    for (int i = 0; i < 16; i++) {
+        w[i] = ((uint32_t) block[i * 4] << 24) |
+               ((uint32_t) block[i * 4 + 1] << 16) |
+               ((uint32_t) block[i * 4 + 2] << 8) |
+               (uint32_t) block[i * 4 + 3];
+    }
+
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = ROTR(w[i - 15], 7) ^ ROTR(w[i - 15], 18) ^
+                      (w[i - 15] >> 3);
+        uint32_t s1 = ROTR(w[i - 2], 17) ^ ROTR(w[i - 2], 19) ^
+                      (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t a = sha->state[0];
+    uint32_t b = sha->state[1];
+    uint32_t c = sha->state[2];
+    uint32_t d = sha->state[3];
+    uint32_t e = sha->state[4];
+    uint32_t f = sha->state[5];
+    uint32_t g = sha->state[6];
+    uint32_t h = sha->state[7];
+
+    for (int i = 0; i < 64; i++) {
+        uint32_t s1 = ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25);
+        uint32_t ch = (e & f) ^ (~e & g);
+        uint32_t t1 = h + s1 + ch + k[i] + w[i];
+        uint32_t s0 = ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22);
+        uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+        uint32_t t2 = s0 + maj;
+
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+
+    sha->state[0] += a;
+    sha->state[1] += b;
+    sha->state[2] += c;
+    sha->state[3] += d;
+    sha->state[4] += e;
+    sha->state[5] += f;
+    sha->state[6] += g;
+    sha->state[7] += h;
+}
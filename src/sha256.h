@@ -0,0 +1,36 @@
+#ifndef LZW_COMPRESSION_SHA256_H
+#define LZW_COMPRESSION_SHA256_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHA256_DIGEST_SIZE 32
+#define SHA256_BLOCK_SIZE 64
+
+/*
+ * Incremental SHA-256 (FIPS 180-4). Feed data with `sha256_update` as it is
+ * read, then get the digest with `sha256_final`.
+ */
+struct sha256 {
+    uint32_t state[8];         // Intermediate hash value.
+    uint64_t len;              // Total bytes fed in so far.
+    uint8_t block[SHA256_BLOCK_SIZE]; // Partial block not yet compressed.
+    size_t block_len;          // Number of bytes in `block`.
+};
+
+void sha256_init(
+        struct sha256 *sha
+);
+
+void sha256_update(
+        struct sha256 *sha,
+        const uint8_t *bytes,
+        size_t size
+);
+
+void sha256_final(
+        struct sha256 *sha,
+        uint8_t digest[SHA256_DIGEST_SIZE]
+);
+
+#endif //LZW_COMPRESSION_SHA256_H